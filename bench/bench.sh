@@ -0,0 +1,292 @@
+#!/bin/bash
+#
+# bench.sh: run flowgen and tcpgen over a veth pair between two
+# throwaway network namespaces, and record pps, bps, cpu cycles per
+# packet and receiver loss of each case to a CSV file. If a baseline
+# CSV exists, every case is compared with it.
+#
+# The sender runs in the namespace of 10.1.0.10 and the receiver
+# (flowgen -e or tcpgen -s) in the namespace of 10.2.0.10, the default
+# addresses of flowgen. Packets and bytes are counted on the sender veth,
+# and cpu time of the sender is read from /proc, or cycles from perf
+# stat if perf is installed.
+#
+# environment:
+#	BENCH_DURATION	seconds of each case (default 5)
+#	BENCH_FILTER	run only cases matching this regex
+#	BENCH_RESULTS	output CSV (default bench/results.csv)
+#	BENCH_BASELINE	baseline CSV (default bench/baseline.csv)
+#	BENCH_TOLERANCE	pps regression in percent to fail (default 5)
+
+DIR=$(cd $(dirname $0)/.. && pwd)
+FLOWGEN=$DIR/flowgen
+TCPGEN=$DIR/tcpgen
+
+DURATION=${BENCH_DURATION:-5}
+FILTER=${BENCH_FILTER:-.}
+RESULTS=${BENCH_RESULTS:-$DIR/bench/results.csv}
+BASELINE=${BENCH_BASELINE:-$DIR/bench/baseline.csv}
+TOLERANCE=${BENCH_TOLERANCE:-5}
+
+TX=fgb-tx-$$
+RX=fgb-rx-$$
+WORKERS=$(nproc)
+
+if [ $(id -u) -ne 0 ]; then
+	echo "bench needs root for network namespaces" >&2
+	exit 1
+fi
+
+if [ ! -x $FLOWGEN ] || [ ! -x $TCPGEN ]; then
+	echo "build flowgen and tcpgen first" >&2
+	exit 1
+fi
+
+cleanup () {
+	ip netns pids $TX 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns pids $RX 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns del $TX 2>/dev/null
+	ip netns del $RX 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+setup () {
+	ip netns add $TX || exit 1
+	ip netns add $RX || exit 1
+	ip link add veth0 netns $TX type veth peer name veth1 netns $RX
+	ip -n $TX addr add 10.1.0.10/24 dev veth0
+	ip -n $RX addr add 10.2.0.10/24 dev veth1
+	ip -n $TX link set lo up
+	ip -n $RX link set lo up
+	ip -n $TX link set veth0 up
+	ip -n $RX link set veth1 up
+	ip -n $TX route add 10.2.0.0/24 dev veth0
+	ip -n $RX route add 10.1.0.0/24 dev veth1
+}
+
+# counter of the sender veth
+txstat () {
+	ip netns exec $TX cat /sys/class/net/veth0/statistics/$1
+}
+
+# field of a line of /proc/net/snmp in a namespace
+snmp () {
+	ip netns exec $1 awk -v proto="$2:" -v key=$3 '
+		$1 == proto && !n { for (i = 2; i <= NF; i++) f[$i] = i; n = 1;
+				    next }
+		$1 == proto { print $f[key] }' /proc/net/snmp
+}
+
+# utime + stime of a process in clock ticks
+cputicks () {
+	awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+cpu_hz () {
+	awk '/^cpu MHz/ { print $4 * 1000000; exit }' /proc/cpuinfo
+}
+
+# run_case NAME TOOL RECEIVER SENDER
+#	RECEIVER and SENDER are argument strings of TOOL
+run_case () {
+	local name=$1 tool=$2 rxargs=$3 txargs=$4
+	local bin rxpid txpid perfpid perfout
+	local p0 p1 b0 b1 t0 t1 c0 c1 r0 r1 s0 s1 cycles
+
+	echo "$name" | grep -Eq "$FILTER" || return
+
+	[ $tool = flowgen ] && bin=$FLOWGEN || bin=$TCPGEN
+
+	ip netns exec $RX $bin $rxargs > /dev/null 2>&1 &
+	rxpid=$!
+	sleep 1
+
+	if ! kill -0 $rxpid 2>/dev/null; then
+		echo "$name: receiver '$tool $rxargs' exited" >&2
+		FAILED=1
+		return
+	fi
+
+	if [ $tool = flowgen ]; then
+		r0=$(( $(snmp $RX Udp InDatagrams) + $(snmp $RX Udp NoPorts) ))
+	else
+		r0=$(snmp $TX Tcp RetransSegs)
+		s0=$(snmp $TX Tcp OutSegs)
+	fi
+	p0=$(txstat tx_packets)
+	b0=$(txstat tx_bytes)
+	t0=$(date +%s.%N)
+
+	ip netns exec $TX $bin $txargs > /dev/null 2>&1 &
+	txpid=$!
+	sleep 0.1
+
+	# a sender that exits early would record an idle veth
+	if ! kill -0 $txpid 2>/dev/null; then
+		echo "$name: sender '$tool $txargs' exited" >&2
+		FAILED=1
+		kill $rxpid 2>/dev/null
+		wait $rxpid 2>/dev/null
+		return
+	fi
+	c0=$(cputicks $txpid)
+
+	if [ -n "$PERF" ]; then
+		perfout=$(mktemp)
+		$PERF stat -x, -e cycles -p $txpid -o $perfout &
+		perfpid=$!
+	fi
+
+	sleep $DURATION
+
+	if ! kill -0 $txpid 2>/dev/null; then
+		echo "$name: sender '$tool $txargs' exited during the run" >&2
+		FAILED=1
+		[ -n "$PERF" ] && kill -INT $perfpid 2>/dev/null
+		kill $rxpid 2>/dev/null
+		wait 2>/dev/null
+		[ -n "$PERF" ] && rm -f $perfout
+		return
+	fi
+
+	c1=$(cputicks $txpid)
+	if [ -n "$PERF" ]; then
+		kill -INT $perfpid
+		wait $perfpid 2>/dev/null
+		cycles=$(awk -F, '/cycles/ { print $1 }' $perfout)
+		rm -f $perfout
+	fi
+	p1=$(txstat tx_packets)
+	b1=$(txstat tx_bytes)
+	t1=$(date +%s.%N)
+
+	kill $txpid 2>/dev/null
+	wait $txpid 2>/dev/null
+	sleep 0.5
+
+	if [ $tool = flowgen ]; then
+		r1=$(( $(snmp $RX Udp InDatagrams) + $(snmp $RX Udp NoPorts) ))
+	else
+		r1=$(snmp $TX Tcp RetransSegs)
+		s1=$(snmp $TX Tcp OutSegs)
+	fi
+
+	kill $rxpid 2>/dev/null
+	wait $rxpid 2>/dev/null
+
+	# loss is not received udp, or retransmitted tcp segments
+	awk -v name=$name -v tool=$tool -v commit=$COMMIT \
+	    -v p=$((p1 - p0)) -v b=$((b1 - b0)) -v t0=$t0 -v t1=$t1 \
+	    -v ticks=$((c1 - c0)) -v tck=$(getconf CLK_TCK) -v hz=$HZ \
+	    -v cycles="$cycles" -v r=$((r1 - r0)) -v s=$((s1 - s0)) '
+	BEGIN {
+		sec = t1 - t0;
+		if (cycles == "" || cycles !~ /^[0-9]+$/)
+			cycles = ticks / tck * hz;
+		if (tool == "flowgen")
+			loss = p ? (p - r) * 100 / p : 0;
+		else
+			loss = s ? r * 100 / s : 0;
+		if (loss < 0)
+			loss = 0;
+		printf "%s,%s,%s,%.2f,%d,%.0f,%.2f,%.1f,%.4f\n", commit, name,
+			tool, sec, p, p / sec, b * 8 / sec / 1e6,
+			p ? cycles / p : 0, loss;
+	}' | tee -a $RESULTS
+}
+
+flowgen_cases () {
+	local be opt flows size dist
+
+	for be in raw udp; do
+		[ $be = udp ] && opt=-u || opt=
+		for flows in 1 64 255; do
+			for size in 64 1500 imix; do
+				run_case flowgen-$be-f$flows-s$size-same \
+					flowgen "-e" \
+					"$opt -n $flows -l $size -t same"
+			done
+		done
+		for dist in random power; do
+			run_case flowgen-$be-f64-s64-$dist flowgen "-e" \
+				"$opt -n 64 -l 64 -t $dist"
+		done
+		run_case flowgen-$be-f64-s64-hugepages flowgen "-e" \
+			"$opt -n 64 -l 64 -H"
+		run_case flowgen-$be-f64-s64-randport flowgen "-e" \
+			"$opt -n 64 -l 64 -r"
+	done
+
+	run_case flowgen-raw-f64-s64-burst flowgen "-e" \
+		"-n 64 -l 64 -B 32,gap=10"
+	run_case flowgen-raw-f64-s64-vxlan flowgen "-e" \
+		"-n 64 -l 128 -E vxlan"
+	run_case flowgen-raw-f64-s64-stamped flowgen "-e" \
+		"-n 64 -l 64 -a"
+}
+
+tcpgen_cases () {
+	local flows dist
+
+	for flows in 1 64; do
+		for dist in same power; do
+			[ $flows = 1 ] && [ $dist = power ] && continue
+			run_case tcpgen-f$flows-$dist-w1 tcpgen "-s" \
+				"-c -d 10.2.0.10 -n $flows -t $dist"
+			[ $WORKERS -gt 1 ] || continue
+			run_case tcpgen-f$flows-$dist-w$WORKERS tcpgen "-s" \
+				"-c -d 10.2.0.10 -n $flows -t $dist -w $WORKERS"
+		done
+	done
+
+	run_case tcpgen-f1024-same-w$WORKERS tcpgen "-s" \
+		"-c -d 10.2.0.10 -n 1024 -w $WORKERS"
+	run_case tcpgen-f16-rpc tcpgen "-s" \
+		"-c -d 10.2.0.10 -n 16 -Q 64,64,depth=8 -k nodelay"
+}
+
+# print pps and cycles of every case against the baseline
+compare () {
+	[ -f $BASELINE ] || {
+		echo "no baseline $BASELINE, make bench-baseline to save one"
+		return 0
+	}
+
+	echo
+	printf "%-36s %12s %12s %8s %10s %10s\n" case "base pps" "pps" \
+		"diff" "base cpp" "cpp"
+	awk -F, -v tol=$TOLERANCE '
+	NR == FNR { if ($1 != "commit") { pps[$2] = $6; cpp[$2] = $8 };
+		    next }
+	$1 == "commit" || !($2 in pps) { next }
+	{
+		diff = pps[$2] ? ($6 - pps[$2]) * 100 / pps[$2] : 0;
+		mark = diff < -tol ? " <-- regression" : "";
+		if (mark)
+			fail = 1;
+		printf "%-36s %12.0f %12.0f %+7.1f%% %10.1f %10.1f%s\n", $2,
+			pps[$2], $6, diff, cpp[$2], $8, mark;
+	}
+	END { exit fail }' $BASELINE $RESULTS
+}
+
+COMMIT=$(git -C $DIR rev-parse --short HEAD 2>/dev/null || echo unknown)
+HZ=$(cpu_hz)
+PERF=$(command -v perf)
+
+FAILED=0
+setup
+
+echo "commit,case,tool,sec,packets,pps,mbps,cycles_per_pkt,loss_pct" \
+	> $RESULTS
+echo "# $(uname -r), $(nproc) cpus, $DURATION sec each, results $RESULTS"
+
+flowgen_cases
+tcpgen_cases
+
+if [ $FAILED -ne 0 ]; then
+	echo "some cases failed to run" >&2
+	exit 1
+fi
+
+compare
@@ -0,0 +1,146 @@
+/* fastrand.h */
+
+/*
+ * Lock-free pseudo random number generator shared by flowgen and tcpgen.
+ *
+ * rand() takes a global lock in glibc and is statistically weak. Each
+ * thread owns a struct fastrand instead. fastrand_next() is xoshiro256**
+ * and fastrand_fill() runs four xoshiro128** lanes with GCC vector
+ * extensions, so bulk filling is vectorized on SSE2/NEON.
+ *
+ * A generator is seeded from (seed, index). Different indexes give
+ * independent streams, so thread N draws the same sequence for a
+ * given seed no matter how many threads run beside it.
+ */
+
+#ifndef _FASTRAND_H_
+#define _FASTRAND_H_
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint32_t fastrand_v4 __attribute__ ((vector_size (16)));
+
+struct fastrand {
+	uint64_t	s[4];		/* xoshiro256** state */
+	fastrand_v4	v[4];		/* 4 lanes of xoshiro128** state */
+};
+
+static inline uint64_t
+fastrand_mix64 (uint64_t x)
+{
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static inline void
+fastrand_init (struct fastrand * r, uint64_t seed, int index)
+{
+	int n, l;
+	uint64_t x;
+
+	/* derive a per-index origin, then walk it with splitmix64 */
+	x = fastrand_mix64 (seed) ^
+		fastrand_mix64 (0x9E3779B97F4A7C15ULL * (index + 1));
+
+	for (n = 0; n < 4; n++) {
+		x += 0x9E3779B97F4A7C15ULL;
+		r->s[n] = fastrand_mix64 (x);
+	}
+
+	for (n = 0; n < 4; n++) {
+		for (l = 0; l < 4; l++) {
+			x += 0x9E3779B97F4A7C15ULL;
+			r->v[n][l] = (uint32_t) fastrand_mix64 (x);
+		}
+	}
+}
+
+static inline uint64_t
+fastrand_rotl (uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t
+fastrand_next (struct fastrand * r)
+{
+	uint64_t * s = r->s;
+	uint64_t result = fastrand_rotl (s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = fastrand_rotl (s[3], 45);
+
+	return result;
+}
+
+/* uniform integer in [0, n) without division (Lemire) */
+static inline uint32_t
+fastrand_range (struct fastrand * r, uint32_t n)
+{
+	return (uint32_t) (((fastrand_next (r) >> 32) * n) >> 32);
+}
+
+/* uniform double in [0, 1) */
+static inline double
+fastrand_double (struct fastrand * r)
+{
+	return (fastrand_next (r) >> 11) * 0x1.0p-53;
+}
+
+static inline fastrand_v4
+fastrand_next_v4 (struct fastrand * r)
+{
+	fastrand_v4 * s = r->v;
+	fastrand_v4 x = s[1] * 5;
+	fastrand_v4 result = ((x << 7) | (x >> 25)) * 9;
+	fastrand_v4 t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+
+	return result;
+}
+
+/* fill buf with n uniform 32bit values, 4 at a time */
+static inline void
+fastrand_fill (struct fastrand * r, uint32_t * buf, int n)
+{
+	int i;
+	fastrand_v4 x;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = fastrand_next_v4 (r);
+		memcpy (buf + i, &x, sizeof (x));
+	}
+
+	if (i < n) {
+		x = fastrand_next_v4 (r);
+		memcpy (buf + i, &x, sizeof (uint32_t) * (n - i));
+	}
+}
+
+/* fill buf with n uniform values in [0, range) */
+static inline void
+fastrand_fill_range (struct fastrand * r, uint32_t * buf, int n,
+		     uint32_t range)
+{
+	int i;
+
+	fastrand_fill (r, buf, n);
+	for (i = 0; i < n; i++)
+		buf[i] = (uint32_t) (((uint64_t) buf[i] * range) >> 32);
+}
+
+#endif /* _FASTRAND_H_ */
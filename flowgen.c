@@ -1,22 +1,60 @@
 /* flowgen.c */
 
+#define _GNU_SOURCE	/* recvmmsg, sendmmsg */
+
 #include <time.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/bpf.h>
+#include <linux/mempolicy.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 
 #include <poll.h>
 
+#include "fastrand.h"
+
+#if defined (FLOWGEN_PROF) && (defined (__x86_64__) || defined (__i386__))
+#include <x86intrin.h>	/* __rdtsc */
+#endif
+
+#ifdef FLOWGEN_DPDK
+#include <rte_eal.h>
+#include <rte_errno.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#endif
+
 #define POLLTIMEOUT	1000 * 1	/* wait time 1 sec */
 
 #define D(_fmt, ...)                                            \
@@ -37,11 +75,53 @@
 
 
 #define DSTPORT		49152
+#define VXLANPORT	4789
+#define MPLSUDPPORT	6635	/* MPLS-in-UDP, RFC 7510 */
 #define SRCPORT_START	49153
 #define SRCPORT_MAX	65534
 #define FLOW_MAX	256
 #define PORTLISTLEN	1000
 #define PACKETMAXLEN	8192
+#define PACKETMINLEN	46	/* 64 byte frame without ether header and FCS */
+#define SIZELISTLEN	8192
+#define SIZEBATCH	64	/* random size indexes drawn at once */
+#define MPLS_LABEL_MAX	8
+#define RSS_KEY_LEN	40
+#define RSS_QUEUE_MAX	256
+#define RSS_INDIR_LEN	128	/* default indirection table size */
+
+#define RX_THREAD_MAX	64
+#define XMIT_MAX	64	/* xmit threads, one per dpdk tx queue */
+#define RING_BLOCK_SIZE	(1 << 20)
+#define RING_BLOCK_NUM	64
+#define RING_FRAME_SIZE	2048
+#define RING_TIMEOUT	10	/* msec to retire a partially filled block */
+
+#define XDP_FLOW_MAX	65536	/* entries of per flow counter map */
+
+#define FLOWGEN_MAGIC	0x666C6F77	/* "flow" */
+#define REFLECT_BATCH	64
+#define TX_BATCH	32	/* packets in a sendmmsg */
+#define TX_RETRY	16	/* sendmmsg resubmits without progress */
+#define RTT_BUCKETS	64	/* log2 histogram of nsec */
+
+#define PROFILE_TICK	1000000	/* re-evaluate load profile every 1ms */
+#define PROFILE_IDLE	(~0ULL)	/* zero rate */
+#define PROFILE_POINT_MAX	4096
+#define LIFE_TICK	1000	/* usec, flow births and deaths */
+
+#define SEARCH_TRIAL	10	/* sec of a trial */
+#define SEARCH_RES	0.5	/* % of rate to stop search */
+#define SEARCH_DRAIN	2	/* sec to wait packets in flight */
+#define SEARCH_SIZE_MAX	16	/* sizes searched one by one */
+
+#define POOL_CHUNK	(2UL << 20)	/* a 2MB hugepage */
+
+#define CLASS_MAX	16	/* traffic classes of a scenario */
+#define CLASS_FLOW_MAX	1024	/* flows (sockets) of a class */
+#define CLASS_LIST_LEN	4096
+#define CLASS_WRITE_MAX	65536	/* bytes of a tcp write */
+#define TCPGEN_PORT	5002	/* tcp classes go to tcpgen -s */
 
 enum {
 	FLOWDIST_SAME,
@@ -49,56 +129,402 @@ enum {
 	FLOWDIST_DWER,
 };
 
-void flow_dist_init_same (void);
-void flow_dist_init_random (void);
-void flow_dist_init_power (void);
+char * flowgen_flow_dist_name[] = { "same", "random", "power" };
+
+enum {
+	PROFILE_RAMP,
+	PROFILE_STEP,
+	PROFILE_SINE,
+	PROFILE_ONOFF,
+	PROFILE_FILE,
+};
+
+enum {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+	DIST_PARETO,
+};
+
+/* a random distribution, see dist_parse () */
+struct dist {
+	int	type;
+	double	a, b;
+};
+
+/* microbursts (-B) */
+#define BURST_REDRAW	16	/* draws of an empty burst before 1 packet */
+struct flowgen_burst {
+	struct dist size;	/* packets in a burst */
+	struct dist gap;	/* usec between bursts */
+	int	per_flow;	/* a burst goes to one flow */
+	FILE	* log;		/* timing of each burst */
+
+	unsigned long	bursts;
+	unsigned long	packets;
+	u_int64_t	nsec;	/* sum of burst durations */
+	u_int64_t	nsec_max;
+};
+
+/* flow lifecycle (-O) */
+struct flowgen_life {
+	double	arrival;	/* flows per sec, 0 for on/off slots */
+	struct dist on;		/* sec of a flow */
+	struct dist off;	/* sec between flows of an on/off slot */
+	int	slots;		/* on/off slots */
+	int	republish;	/* flow dist changed by control socket */
+	u_int64_t next_arrival;
+	struct {
+		int		live;
+		int		dead_tick;	/* reusable after it */
+		u_int64_t	until;	/* death, or birth of on/off slot */
+	} slot[FLOW_MAX];
+	u_int8_t used[SRCPORT_MAX + 1];	/* source ports in flows */
+	struct fastrand rnd;
+
+	int	live;
+	unsigned long	births;
+	unsigned long	deaths;
+	unsigned long	blocked;	/* arrivals without a free slot */
+};
+
+/* maximum rate search (-b) */
+struct search {
+	double	lo, hi;		/* pps */
+	double	trial;		/* sec */
+	double	loss;		/* acceptable loss % */
+	double	res;		/* stop when hi - lo is under res % of hi */
+	int	all_dist;	/* search each flow distribution */
+};
+
+struct search_result {
+	int	dist;
+	int	mix;		/* all sizes of -l */
+	double	size;		/* average packet size */
+	double	pps;
+	double	loss;
+};
+
+struct profile_point {
+	double	sec;
+	double	pps;
+	int	flows;		/* 0 means unchanged */
+};
+
+/* time varying load (-P). never freed once used by a config */
+struct flowgen_profile {
+	int	shape;
+	double	lo, hi;		/* pps */
+	double	t1, t2;		/* duration, period, or on and off sec */
+	int	steps;
+	int	flow_lo, flow_hi;	/* flows follow the rate if set */
+	u_int64_t start;	/* CLOCK_MONOTONIC nsec */
+
+	int	point_num;
+	struct profile_point points[PROFILE_POINT_MAX];
+};
+
+/* xmit parameters changeable at runtime. a new one is built and
+ * swapped as a whole, and the xmit loop never sees a partial update */
+struct flowgen_conf {
+	int	flow_dist;		/* type of flow distribution */
+	int	flow_num;		/* number of active flows */
+	int	paused;			/* xmit nothing */
+	u_int64_t gap;			/* nsec between packets, 0 unlimited */
+	struct flowgen_profile * profile;	/* overrides gap */
+	struct flowgen_burst * burst;	/* overrides gap and profile */
+
+	int	flow_list_len;		/* num of filled flow list */
+	int	flow_list[PORTLISTLEN + FLOW_MAX];	/* flow index list */
+
+	struct flowgen_conf * retired;	/* replaced, not yet freed */
+};
+
+void flow_dist_init_same (struct flowgen_conf * c);
+void flow_dist_init_random (struct flowgen_conf * c);
+void flow_dist_init_power (struct flowgen_conf * c);
 
-void (* flowgen_flow_dist_init[]) (void) = {
+void (* flowgen_flow_dist_init[]) (struct flowgen_conf * c) = {
 	flow_dist_init_same,
 	flow_dist_init_random,
 	flow_dist_init_power,
 };
 
+enum {
+	BACKEND_RAW,
+	BACKEND_UDP,
+#ifdef FLOWGEN_DPDK
+	BACKEND_DPDK,
+#endif
+};
+
+enum {
+	REFLECT_NONE,
+	REFLECT_UDP,
+	REFLECT_PACKET,
+};
+
+enum {
+	ENCAP_NONE,
+	ENCAP_VXLAN,
+	ENCAP_GRE,
+	ENCAP_IPIP,
+	ENCAP_MPLS,
+};
+
 
 #define DEFAULT_SRCADDR		"10.1.0.10"
 #define DEFAULT_DSTADDR		"10.2.0.10"
+#define DEFAULT_SRCADDR6	"fd00:1::10"
+#define DEFAULT_DSTADDR6	"fd00:2::10"
 #define DEFAULT_FLOWNUM		10
 #define DEFAULT_FLOWDIST	FLOWDIST_SAME
 #define DEFAULT_PACKETLEN	1010
 
 
+/* a pre-built packet for one packet size */
+struct pkt_tmpl {
+	int	len;		/* packet length (ip total length) */
+	u_int32_t csum;		/* udp checksum without source port */
+	char	* pkt;		/* ip header and following */
+
+	int	inner;		/* offset of inner (flow) ip header */
+	int	udp;		/* offset of inner udp header */
+	u_int32_t label_word;	/* first word of inner ipv6 header or 0 */
+	int	entropy_off;	/* offset of outer udp source port or 0 */
+	int	key_off;	/* offset of vni or gre key or 0 */
+	int	outer_csum_off;	/* offset of outer udp checksum or 0 */
+	u_int32_t outer_csum;	/* outer udp checksum without flow fields */
+	int	hdr_off;	/* offset of struct flowgen_hdr or 0 */
+};
+
+/* head of udp payload when stamped (-a), all in network byte order */
+struct flowgen_hdr {
+	u_int32_t	magic;
+	u_int32_t	seq;		/* per flow sequence number */
+	u_int64_t	tstamp;		/* xmit time, CLOCK_REALTIME nsec */
+};
+
+/* round trip time statistics */
+struct rtt_stat {
+	unsigned long	count;
+	u_int64_t	sum;		/* nsec */
+	u_int64_t	min;
+	u_int64_t	max;
+	unsigned long	hist[RTT_BUCKETS];
+};
+
+/* per flow values patched into a template when xmitted */
+struct flow {
+	u_int16_t	sport;		/* udp source port */
+	u_int16_t	entropy;	/* outer udp source port (net order) */
+	u_int32_t	key;		/* vni or gre key word (net order) */
+	u_int32_t	label;		/* ipv6 flow label */
+	u_int32_t	seq;		/* next sequence number */
+};
+
+/* a TPACKET_V3 rx ring of a receive thread */
+struct rx_ring {
+	int		index;
+	int		sock;
+	u_int8_t	* map;
+	struct tpacket_req3 req;
+	pthread_t	tid;
+
+	unsigned long	packets;	/* received packets */
+	unsigned long	bytes;		/* received bytes */
+	unsigned long	fg_packets;	/* flowgen packets in them */
+	unsigned long	reflected;	/* packets sent back */
+	struct rtt_stat	rtt;		/* of reflected flowgen packets */
+};
+
+/* flow headers of a received packet */
+struct pkt_info {
+	int		af;		/* family of flow ip header */
+	u_int8_t	* l3;		/* flow ip header */
+	struct udphdr	* udp;		/* flow udp header */
+	int		len;		/* udp header and payload length */
+	int		reflected;	/* sent back by a reflector */
+
+	int		outer_af;	/* outermost ip header */
+	u_int8_t	* outer_l3;
+};
+
+/* key and value of the per flow counter map of the xdp sink */
+struct xdp_flow_key {
+	u_int8_t	saddr[16];	/* ipv6, or ipv4 and zeros */
+	u_int16_t	sport;		/* network byte order */
+	u_int16_t	ipv;		/* 4 or 6 */
+};
+
+struct xdp_flow_val {
+	u_int64_t	packets;
+	u_int64_t	bytes;
+};
+
+/* an ipv4 or ipv6 address */
+struct addr {
+	int	af;
+	union {
+		struct in_addr	v4;
+		struct in6_addr	v6;
+	};
+};
+
+
+/* a traffic class of a scenario (-Z) */
+enum {
+	CLASS_UDP,
+	CLASS_TCP,
+};
+
+struct flowgen_class {
+	char	name[32];
+	int	proto;
+	struct addr dst;
+	int	port;
+	int	flow_num;
+	int	flow_dist;
+	struct dist size;	/* bytes of a datagram or write */
+	double	rate;		/* per sec, 0 is as fast as possible */
+	double	start;		/* sec after the scenario starts */
+	double	duration;	/* sec, 0 runs until the scenario ends */
+	int	rtt;		/* stamp and read reflected packets */
+
+	int	socks[CLASS_FLOW_MAX];
+	int	list_len;
+	u_int16_t list[CLASS_LIST_LEN];	/* flow list to follow dist */
+	struct fastrand rnd;
+	pthread_t tid;
+	int	done;
+	int	alive;		/* flows not closed on an error */
+	u_int64_t begin;	/* active interval, CLOCK_MONOTONIC nsec */
+	u_int64_t stop;
+
+	unsigned long	packets;
+	unsigned long	bytes;
+	unsigned long	errors;
+	struct rtt_stat	rtt_stat;
+};
+
+struct scenario {
+	int	num;
+	double	duration;	/* sec, 0 is unlimited */
+	u_int64_t start;	/* CLOCK_MONOTONIC nsec */
+	u_int64_t end;
+	struct flowgen_class c[CLASS_MAX];
+};
+
+/* packet buffer pool, see flowgen_pool_alloc () */
+struct pool {
+	char	* base;		/* current chunk */
+	size_t	len;
+	size_t	used;
+};
+
+
 struct flowgen {
 
 	int socket;			/* raw socket		*/
 	int rsocket;			/* receive socket 	*/
-	struct sockaddr_in saddr_in;
-
-	struct in_addr saddr;		/* source address	*/
-	struct in_addr daddr;		/* destination address	*/
-
-	int	port_list_len;		/* num of filled port list 	*/
-	int	port_list[PORTLISTLEN];	/* srcport list  		*/
-	int	port_candidates[PORTLISTLEN];
+	struct sockaddr_storage dst_sa;	/* destination of sendto */
+	socklen_t dst_salen;
+
+	struct addr saddr;		/* source address	*/
+	struct addr daddr;		/* destination address	*/
+	int	label_num;		/* flow labels per source port */
+
+	struct flow flows[FLOW_MAX];
+	int	flow_cap;		/* num of flows with ports */
+
+	int	encap;			/* type of encapsulation */
+	struct addr outer_saddr;	/* tunnel source address */
+	struct addr outer_daddr;	/* tunnel destination address */
+	int	encap_key;		/* vni or gre key is used */
+	u_int32_t encap_key_min;	/* vni or gre key range */
+	u_int32_t encap_key_max;
+	int	mpls_label_num;
+	u_int32_t mpls_label[MPLS_LABEL_MAX];
+
+	int	rss_queues;		/* num of rx queues to spread over */
+	int	rss_indir_len;		/* size of indirection table */
+	u_int8_t rss_key[RSS_KEY_LEN];	/* toeplitz hash key */
+	float	rss_weight[RSS_QUEUE_MAX];	/* ratio of flows for queues */
 
 	int	flow_dist;		/* type of flow distribution */
 	int	flow_num;		/* number of flows	*/
 
-	int	pkt_len;		/* packet length */
-	char 	pkt[PACKETMAXLEN];	/* test packet */
+	char	* size_spec;		/* packet size distribution (-l) */
+	int	tmpl_num;		/* num of packet templates */
+	struct pkt_tmpl tmpls[PACKETMAXLEN];	/* template for each size */
+	int	size_list_len;		/* num of filled size list */
+	u_int16_t size_list[SIZELISTLEN];	/* tmpl index list */
 
 	int	interval;		/* xmit interval */
 	int	recv_mode;		/* recv mode */
 	int	recv_mode_only;		/* recv mode only */
 	int	randomized;		/* randomize source port ? */
-	int	count;			/* number of xmit packets */
+	unsigned long count;		/* number of xmit packets */
 	int	udp_mode;		/* udp socket instead of raw socket */
+	int	backend;		/* xmit I/O backend */
+
+	struct flowgen_conf * conf;	/* current runtime config */
+	struct flowgen_conf * conf_seen[XMIT_MAX];	/* in use by xmit */
+	struct flowgen_conf * conf_retired;	/* freed by a later swap */
+	u_int32_t conf_gen;		/* futex, bumped on every swap */
+	int	xmit_threads;		/* share the flow list, default 1 */
+	char	* ctl_path;		/* control socket path */
+	int	ctl_sock;
+	struct flowgen_profile * profile;	/* -P */
+	struct flowgen_burst * burst;	/* -B */
+	struct flowgen_life * life;	/* -O */
+	struct scenario * scenario;	/* -Z */
+	int	searching;		/* -b */
+	struct search search;
+	unsigned long rx_packets;	/* by udp receive thread */
+	unsigned long tx_packets;	/* xmit counters */
+	unsigned long tx_bytes;
+	unsigned long tx_errors;
+	unsigned long tx_missed;	/* launch time missed (-j) */
+	unsigned long tx_invalid;	/* launch time rejected (-j) */
+	u_int64_t tx_gap;		/* current gap of the pacer */
+	pthread_mutex_t conf_lock;	/* serializes config writers */
 	int	verbose;		/* verbose mode */
 
+	char	* rx_ifname;		/* receive with packet ring */
+	int	rx_threads;		/* num of rx rings and threads */
+	int	rx_fanout;		/* PACKET_FANOUT mode */
+	struct rx_ring rx_rings[RX_THREAD_MAX];
+	int	xdp;			/* count and drop with xdp */
+	int	reflect;		/* reflector mode */
+	int	tstamp;			/* stamp seq and time on packets */
+
+	u_int64_t txtime;		/* -j, nsec of lead */
+	int	txtime_clock;
+	int	txtime_flags;
+	int64_t	txtime_off;		/* txtime clock - monotonic */
+	int64_t	txtime_stamp_off;	/* stamp clock - monotonic */
+
+	int	hugepage;		/* -H */
+	int	numa_node;		/* -N, or -1 */
+	int	numa_cpus[CPU_SETSIZE];	/* cpus of the node */
+	int	numa_cpu_num;
+	struct pool pool;
+	struct tx_batch * batch[XMIT_MAX];	/* of each xmit thread */
+
+	unsigned long seed;		/* seed of random generators */
+	struct fastrand rnd;		/* setup time random (stream 0) */
+
 } flowgen;
 
 int cnt = 0; /* XXX dce debug */
 
 #define IS_V() flowgen.verbose
+#ifdef FLOWGEN_DPDK
+#define IS_DPDK() (flowgen.backend == BACKEND_DPDK)
+#else
+#define IS_DPDK() 0
+#endif
 
 /* from netmap pkt-gen.c */
 static uint16_t
@@ -135,26 +561,206 @@ wrapsum (u_int32_t sum)
 	return (htons(sum));
 }
 
+static inline u_int32_t
+csum_add (u_int32_t sum, u_int16_t v)
+{
+	sum += v;
+	if (sum > 0xFFFF)
+		sum -= 0xFFFF;
+	return sum;
+}
+
+static inline u_int16_t
+udp_wrapsum (u_int32_t sum)
+{
+	sum = ~sum & 0xFFFF;
+
+	/* 0 means no checksum for udp */
+	return htons (sum ? sum : 0xFFFF);
+}
+
+/* finish udp checksum of a template with the source port */
+static inline u_int16_t
+udp_sum_port (u_int32_t sum, u_int16_t port)
+{
+	return udp_wrapsum (csum_add (sum, port));
+}
+
+static inline u_int64_t
+nsec_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* write sequence and time to the payload of pkt built from t.
+ * returns the checksum of them to be passed to flowgen_tmpl_patch().
+ * the xmit loop gives the sequence number back if pkt is not sent. */
+static inline u_int32_t
+flowgen_tmpl_stamp (struct pkt_tmpl * t, struct flow * f, char * pkt,
+		    u_int64_t now)
+{
+	u_int32_t seq, sum;
+	u_int64_t ts;
+
+	if (!t->hdr_off)
+		return 0;
+
+	seq = htonl (f->seq);
+	ts = htobe64 (now);
+	memcpy (pkt + t->hdr_off + offsetof (struct flowgen_hdr, seq),
+		&seq, sizeof (seq));
+	memcpy (pkt + t->hdr_off + offsetof (struct flowgen_hdr, tstamp),
+		&ts, sizeof (ts));
+
+	sum = csum_add (f->seq >> 16, f->seq & 0xFFFF);
+	sum = csum_add (sum, now >> 48);
+	sum = csum_add (sum, (now >> 32) & 0xFFFF);
+	sum = csum_add (sum, (now >> 16) & 0xFFFF);
+	sum = csum_add (sum, now & 0xFFFF);
+	f->seq++;
+
+	return sum;
+}
+
+/* rewrite per flow fields of pkt copied from template t. extra is
+ * the checksum of other rewritten payload. */
+static inline void
+flowgen_tmpl_patch (struct pkt_tmpl * t, struct flow * f, char * pkt,
+		    u_int32_t extra)
+{
+	u_int16_t csum;
+	u_int32_t sum, word;
+	struct udphdr * udp;
+
+	udp = (struct udphdr *) (pkt + t->udp);
+	udp->uh_sport = htons (f->sport);
+	udp->uh_sum = csum = udp_sum_port (csum_add (t->csum, extra),
+					   f->sport);
+
+	if (t->label_word) {
+		word = htonl (t->label_word | f->label);
+		memcpy (pkt + t->inner, &word, sizeof (word));
+	}
+	if (t->entropy_off)
+		memcpy (pkt + t->entropy_off, &f->entropy,
+			sizeof (f->entropy));
+	if (t->key_off)
+		memcpy (pkt + t->key_off, &f->key, sizeof (f->key));
+
+	if (t->outer_csum_off) {
+		/* outer udp over ipv6 covers all the fields above */
+		sum = csum_add (t->outer_csum, f->sport);
+		sum = csum_add (sum, extra);
+		sum = csum_add (sum, ntohs (csum));
+		sum = csum_add (sum, ntohs (f->entropy));
+		if (t->key_off) {
+			sum = csum_add (sum, ntohl (f->key) >> 16);
+			sum = csum_add (sum, ntohl (f->key) & 0xFFFF);
+		}
+		if (t->label_word) {
+			sum = csum_add (sum, f->label >> 16);
+			sum = csum_add (sum, f->label & 0xFFFF);
+		}
+		csum = udp_wrapsum (sum);
+		memcpy (pkt + t->outer_csum_off, &csum, sizeof (csum));
+	}
+}
+
+static int
+addr_parse (char * str, struct addr * a)
+{
+	if (inet_pton (AF_INET, str, &a->v4) == 1)
+		a->af = AF_INET;
+	else if (inet_pton (AF_INET6, str, &a->v6) == 1)
+		a->af = AF_INET6;
+	else
+		return -1;
+
+	return 0;
+}
+
+static inline int
+addr_len (struct addr * a)
+{
+	return a->af == AF_INET ? sizeof (a->v4) : sizeof (a->v6);
+}
+
+static inline int
+iphdr_len (int af)
+{
+	return af == AF_INET ? sizeof (struct ip) : sizeof (struct ip6_hdr);
+}
+
+static u_int64_t
+addr_hash (struct addr * a)
+{
+	u_int64_t h[2];
+
+	if (a->af == AF_INET)
+		return fastrand_mix64 (a->v4.s_addr);
+
+	memcpy (h, &a->v6, sizeof (h));
+	return fastrand_mix64 (h[0] ^ fastrand_mix64 (h[1]));
+}
+
 void
 usage (char * progname)
 {
 	printf ("\n"
 		"usage: %s"
 		"\n"
-		"\t" "-s : Source IP address (default 10.1.0.10)\n"
-		"\t" "-d : Destination IP address (default 10.2.0.10)\n"
+		"\t" "-s : Source IP address (default 10.1.0.10 or fd00:1::10)\n"
+		"\t" "-d : Destination IP address (default 10.2.0.10 or fd00:2::10)\n"
 		"\t" "-n : Number of flows (default 10)\n"
 		"\t" "-t : Type of flow distribution {same|random|power}"
 		" (default same)\n"
 		"\t" "-l : Packet size (excluding ether header 14byte)\n"
+		"\t" "     SIZE | imix | SIZE:WEIGHT,... | MIN-MAX"
+		" | cdf:FILE\n"
 		"\t" "-i : packet send interval (micro second)\n"
-		"\t" "-m : Seed of srand\n"
+		"\t" "-m : Seed of random generator\n"
 		"\t" "-f : daemon mode\n"
 		"\t" "-r : Randomize source ports of each flows\n"
 		"\t" "-c : Number of xmit packets (defualt unlimited)\n"
 		"\t" "-e : Receive mode\n"
 		"\t" "-u : using UDP socket instead of raw socket\n"
 		"\t" "-w : Run WITH receive thread\n"
+		"\t" "-E : Encapsulation {vxlan[:VNI[-VNI]]|gre[:KEY[-KEY]]|"
+		"ipip|mpls:LABEL[/LABEL...]}\n"
+		"\t" "-S : Tunnel source IP address (default -s)\n"
+		"\t" "-D : Tunnel destination IP address (default -d)\n"
+		"\t" "-L : Number of IPv6 flow labels for each source port\n"
+		"\t" "-R : Spread flows over RSS queues "
+		"QUEUES[,indir=N][,key=HEX][,weights=W/W/...]\n"
+		"\t" "-I : Receive on the interface with TPACKET_V3 rings\n"
+		"\t" "-T : Number of receive threads with -I (default 1)\n"
+		"\t" "-F : Fanout mode of receive threads {hash|cpu}"
+		" (default hash)\n"
+		"\t" "-X : Count and drop flowgen packets by XDP on -I, "
+		"not with -E\n"
+		"\t" "-a : Stamp sequence and time, and measure round trip\n"
+		"\t" "-M : Reflector mode {udp|packet}, packet needs -I\n"
+		"\t" "-C : Path of control socket to change xmit at runtime\n"
+		"\t" "-P : Load profile {ramp:LO-HI:SEC|step:LO-HI:SEC:STEPS|"
+		"sine:LO-HI:PERIOD|\n"
+		"\t" "     onoff:LO-HI:ON:OFF}[,flows=LO-HI] | file:PATH"
+		" (rates in pps)\n"
+		"\t" "-B : Microbursts SIZE[,gap=USEC][,flow][,log=FILE]\n"
+		"\t" "     SIZE and USEC are {V|A-B|exp:MEAN|pareto:ALPHA:MIN}\n"
+		"\t" "-O : Flow lifecycle {arrival=RATE,on=SEC|on=SEC[,off=SEC]}\n"
+		"\t" "     SEC are distributions as -B\n"
+		"\t" "-b : Search max rate without loss with -w "
+		"LO-HI[,trial=SEC][,loss=PCT][,res=PCT][,dist=all]\n"
+		"\t" "-j : Launch time with SO_TXTIME, USEC ahead "
+		"USEC[,fq][,deadline]\n"
+		"\t" "-H : Packet buffers on 2MB hugepages\n"
+		"\t" "-N : NUMA node of memory and threads {NODE|IFNAME}\n"
+		"\t" "-Z : Scenario file of udp and tcp traffic classes\n"
+		"\t" "-K : DPDK backend 'EAL_ARGS [-- port=N,dmac=MAC,txq=N]'"
+		" (make DPDK=yes)\n"
 		"\n",
 		progname);
 
@@ -165,69 +771,76 @@ void
 flowgen_default_value_init (void)
 {
 	memset (&flowgen, 0, sizeof (struct flowgen));
+	pthread_mutex_init (&flowgen.conf_lock, NULL);
 
 	/* set default ip addresses */
-	inet_pton (AF_INET, DEFAULT_SRCADDR, &flowgen.saddr);
-	inet_pton (AF_INET, DEFAULT_DSTADDR, &flowgen.daddr);
+	addr_parse (DEFAULT_SRCADDR, &flowgen.saddr);
+	addr_parse (DEFAULT_DSTADDR, &flowgen.daddr);
 
 	/* set default flow related values */
 	flowgen.flow_dist = DEFAULT_FLOWDIST;
 	flowgen.flow_num = DEFAULT_FLOWNUM;
 
-	flowgen.pkt_len = DEFAULT_PACKETLEN;
+	flowgen.size_spec = NULL;
 
 	flowgen.count = 0;
+	flowgen.numa_node = -1;
+	flowgen.xmit_threads = 1;
 
 	return;
 }
 
 
-void
-flowgen_socket_init (void)
-{
-	int sock, on = 1;
-
-
-	/* fill sock addr */
-	flowgen.saddr_in.sin_addr = flowgen.daddr;
-	flowgen.saddr_in.sin_family = AF_INET;
-	flowgen.saddr_in.sin_port = htons (DSTPORT);
+/*
+ * I/O backends. The xmit loop picks flows and sizes and builds a batch
+ * of frames, and a backend only moves them to the wire.
+ */
 
+struct tx_slot {
+	struct pkt_tmpl	* t;
+	struct flow	* f;
+	u_int64_t	txtime;			/* departure, -j */
+	char		buf[PACKETMAXLEN];	/* frame built from t for f */
+};
 
-	if (flowgen.udp_mode) {
-		if ((sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-			D ("failed to create udp socket");
-			perror ("socket");
-			exit (1);
-		}
-#ifdef UDPCONNECT
-		struct sockaddr_in saddr_in;
-		memset (&saddr_in, 0, sizeof (saddr_in));
-		saddr_in.sin_family = AF_INET;
-		saddr_in.sin_addr.s_addr = INADDR_ANY;
+struct tx_batch {
+	int		num;
+#ifdef FLOWGEN_DPDK
+	int		queue;			/* dpdk tx queue */
+	struct rte_mbuf	* mbufs[TX_BATCH];	/* frames of slots */
+#endif
+	struct tx_slot	slot[TX_BATCH];
+	struct iovec	iovs[TX_BATCH];
+	struct mmsghdr	msgs[TX_BATCH];
+	char		cmsgs[TX_BATCH][CMSG_SPACE (sizeof (u_int64_t))];
+};
 
-		D ("bind");
-		if (bind (sock, (struct sockaddr *)&saddr_in,
-			  sizeof (struct sockaddr_in)) < 0)
-			perror ("bind");
+struct flowgen_backend {
+	char	* name;
+	void	(* open) (void);			/* create sockets */
+	/* memory of slot i holding its template, or NULL if there is no
+	 * room. without it, frames are copied to slot buf. */
+	char *	(* frame) (struct tx_batch * b, int i);
+	void	(* prepare) (struct tx_batch * b);	/* point msgs at frames */
+	int	(* submit) (struct tx_batch * b);	/* returns num sent or -1 */
+	void	(* reap) (struct tx_batch * b);		/* completions, or NULL */
+	void	(* stats) (void);			/* own counters, or NULL */
+};
 
-		D ("connect");
-		if (connect (sock, (struct sockaddr *)&flowgen.saddr_in, 
-			     sizeof (struct sockaddr_in)) < 0)
-			perror ("connect");
-#endif
-		flowgen.socket = sock;
-		return;
-	}
+static void
+backend_raw_open (void)
+{
+	int sock, on = 1, af = flowgen.outer_daddr.af;
 
-	/* create raw socket */
-	if ((sock = socket (AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0) {
+	/* create raw socket. IPPROTO_RAW implies IPV6_HDRINCL on ipv6 */
+	if ((sock = socket (af, SOCK_RAW, IPPROTO_RAW)) < 0) {
 		D ("failed to create raw socket");
 		perror ("socket");
 		exit (1);
 	}
 
-	if (setsockopt (sock, IPPROTO_IP, IP_HDRINCL, &on, sizeof (on)) < 0) {
+	if (af == AF_INET &&
+	    setsockopt (sock, IPPROTO_IP, IP_HDRINCL, &on, sizeof (on)) < 0) {
 		D ("failed to set sockopt HDRINCL");
 		perror ("setsockopt");
 		exit (1);
@@ -237,378 +850,4862 @@ flowgen_socket_init (void)
 		D ("raw socket is %d", sock);
 
 	flowgen.socket = sock;
+}
 
-	return;
+static void
+backend_raw_prepare (struct tx_batch * b)
+{
+	int n;
+	struct msghdr * m;
+
+	for (n = 0; n < b->num; n++) {
+		b->iovs[n].iov_base = b->slot[n].buf;
+		b->iovs[n].iov_len = b->slot[n].t->len;
+		m = &b->msgs[n].msg_hdr;
+		m->msg_name = &flowgen.dst_sa;
+		m->msg_namelen = flowgen.dst_salen;
+		m->msg_iov = &b->iovs[n];
+		m->msg_iovlen = 1;
+	}
 }
 
-void
-flowgen_packet_init (void)
+static void
+backend_udp_open (void)
 {
-	struct ip * ip;
-	struct udphdr * udp;
+	int sock;
 
-	/* fill ip header */
-	ip = (struct ip *) flowgen.pkt;
+	if ((sock = socket (flowgen.outer_daddr.af, SOCK_DGRAM,
+			    IPPROTO_UDP)) < 0) {
+		D ("failed to create udp socket");
+		perror ("socket");
+		exit (1);
+	}
 
-	ip->ip_v	= IPVERSION;
-	ip->ip_hl	= 5;
-	ip->ip_id	= 0;
-	ip->ip_tos	= IPTOS_LOWDELAY;
-	ip->ip_len	= htons (flowgen.pkt_len);
-	ip->ip_off	= 0;
-	ip->ip_ttl	= 16;
-	ip->ip_p	= IPPROTO_UDP;
-	ip->ip_dst	= flowgen.daddr;
-	ip->ip_src	= flowgen.saddr;
-	ip->ip_sum	= 0;
-	ip->ip_sum	= wrapsum (checksum (ip, sizeof (*ip), 0));
+	if (IS_V()) 
+		D ("udp socket is %d", sock);
 
+	flowgen.socket = sock;
+}
 
-	/* fill udp header */
-	udp = (struct udphdr *) (ip + 1);
+static void
+backend_udp_prepare (struct tx_batch * b)
+{
+	int n, hlen;
+	struct pkt_tmpl * t;
+
+	/* kernel builds headers, xmit udp payload only */
+	backend_raw_prepare (b);
+	for (n = 0; n < b->num; n++) {
+		t = b->slot[n].t;
+		hlen = t->udp + sizeof (struct udphdr);
+		b->iovs[n].iov_base = b->slot[n].buf + hlen;
+		b->iovs[n].iov_len = t->len - hlen;
+	}
+}
 
-	udp->uh_dport	= htons (DSTPORT);
-	udp->uh_sport	= 0;	/* filled when xmitted */
-	udp->uh_ulen	= htons (flowgen.pkt_len - sizeof (*ip));
-	udp->uh_sum	= 0;	/* no checksum */
+static int
+backend_sock_submit (struct tx_batch * b)
+{
+	int sent = 0, ret = 0, idle = 0;
+
+	/* sendmmsg stops at the first message that fails. resubmit the
+	 * rest while the kernel is short of buffers, as the dpdk backend
+	 * waits for room in the tx ring. */
+	while (sent < b->num && idle < TX_RETRY) {
+		ret = sendmmsg (flowgen.socket, b->msgs + sent,
+				b->num - sent, 0);
+		if (ret > 0) {
+			sent += ret;
+			idle = 0;
+		} else if (ret < 0 && errno != ENOBUFS && errno != EAGAIN)
+			break;
+		else
+			idle++;
+	}
 
-	return;
-};
+	return sent || ret >= 0 ? sent : -1;
+}
 
-void
-flowgen_port_candidates_init (void)
+#ifdef FLOWGEN_DPDK
+/*
+ * DPDK backend (make DPDK=yes, -K). EAL takes the port, a real NIC or a
+ * virtual device such as net_null, net_tap, net_af_packet or net_ring.
+ * Each packet template has its own xmit pool, and its mbufs hold the
+ * ethernet header and the whole template from the pool creation. A
+ * packet is an mbuf of the pool of its size, and the xmit loop patches
+ * only the per flow fields in place. With more templates than
+ * DPDK_TMPL_POOLS, a shared pool has the ethernet header, and the
+ * template is copied to the mbuf. Each of txq= xmit threads sends on
+ * its own tx queue. With -e or -w, each of -T receive threads polls
+ * its own rx queue, and RSS of the port shards flows over the queues.
+ */
+
+#define DPDK_ARGS_MAX	64
+#define DPDK_TMPL_POOLS	8	/* templates with their own pool */
+#define DPDK_TX_MBUFS	4095	/* more than a tx ring and a batch */
+#define DPDK_RX_MBUFS	8191	/* for each rx queue */
+#define DPDK_CACHE	256
+#define DPDK_DESC	1024
+#define DPDK_BURST	32
+#define DPDK_TX_RETRY	100000	/* bursts without progress to give up */
+
+struct flowgen_dpdk {
+	int		argc;
+	char		* argv[DPDK_ARGS_MAX];	/* EAL arguments */
+	u_int16_t	port;
+	u_int8_t	dmac[ETH_ALEN];		/* broadcast by default */
+	u_int8_t	smac[ETH_ALEN];		/* of the port */
+	int		rxq;			/* rx queues */
+	int		txq;			/* tx queues, xmit threads */
+	int		tmpl_pools;		/* 0 with the shared pool */
+	struct rte_mempool * tmpl_pool[DPDK_TMPL_POOLS];
+	struct rte_mempool * tx_pool;		/* ethernet header prefilled */
+	struct rte_mempool * rx_pool;
+	unsigned long	tx_nombuf;		/* frames without mbuf */
+} dpdk;
+
+/* EAL_ARGS [-- port=N,dmac=MAC,txq=N] */
+static int
+flowgen_dpdk_parse (char * spec)
 {
-	int n, i, candidate;
-	
-	if (!flowgen.randomized) {
-		for (n = 0; n < flowgen.flow_num; n++) {
-			flowgen.port_candidates[n] = SRCPORT_START + n;
-			D ("Flow %2d is src port %d", n,
-			   flowgen.port_candidates[n]);
+	char * tok, * save, * opt = NULL;
+	u_int8_t * m = dpdk.dmac;
+
+	memset (dpdk.dmac, 0xFF, sizeof (dpdk.dmac));
+	dpdk.argv[dpdk.argc++] = "flowgen";
+	dpdk.txq = 1;
+
+	for (tok = strtok_r (spec, " \t", &save); tok;
+	     tok = strtok_r (NULL, " \t", &save)) {
+		if (strcmp (tok, "--") == 0) {
+			opt = strtok_r (NULL, "", &save);
+			break;
 		}
-		return;
+		if (dpdk.argc == DPDK_ARGS_MAX - 1) {
+			D ("too many EAL arguments");
+			return -1;
+		}
+		dpdk.argv[dpdk.argc++] = tok;
 	}
 
-	/* randomize udp source port  */
-	for (n = 0; n < flowgen.flow_num; n++) {
-		while (1) {
-			candidate = SRCPORT_START +
-				rand () % (SRCPORT_MAX - SRCPORT_START);
-			for (i = 0; i < n; i++) {
-				if (flowgen.port_candidates[i] == candidate)
-					break;
+	if (!opt)
+		return 0;
+
+	for (tok = strtok_r (opt, ", \t", &save); tok;
+	     tok = strtok_r (NULL, ", \t", &save)) {
+		if (strncmp (tok, "port=", 5) == 0)
+			dpdk.port = atoi (tok + 5);
+		else if (strncmp (tok, "txq=", 4) == 0) {
+			dpdk.txq = atoi (tok + 4);
+			if (dpdk.txq < 1 || XMIT_MAX < dpdk.txq) {
+				D ("txq must be 1 to %d", XMIT_MAX);
+				return -1;
 			}
-			if (i == n)
-				break;
+		} else if (strncmp (tok, "dmac=", 5) == 0) {
+			if (sscanf (tok + 5, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+				    &m[0], &m[1], &m[2], &m[3], &m[4],
+				    &m[5]) != 6) {
+				D ("invalid mac address %s", tok + 5);
+				return -1;
+			}
+		} else {
+			D ("invalid dpdk option %s", tok);
+			return -1;
 		}
-		flowgen.port_candidates[n] = candidate;
-		D ("Flow %2d is src port %d", n, candidate);
 	}
 
-	return;
+	return 0;
 }
 
+/* write the ethernet header, and template arg if any, to an mbuf of
+ * an xmit pool. they stay there while the mbuf is recycled. */
+static void
+flowgen_dpdk_prefill (struct rte_mempool * mp, void * arg, void * obj,
+		      unsigned idx)
+{
+	u_int8_t * p = rte_pktmbuf_mtod ((struct rte_mbuf *) obj, u_int8_t *);
+	u_int16_t type = htons (flowgen.outer_daddr.af == AF_INET ?
+				ETH_P_IP : ETH_P_IPV6);
+	struct pkt_tmpl * t = arg;
+
+	memcpy (p, dpdk.dmac, ETH_ALEN);
+	memcpy (p + ETH_ALEN, dpdk.smac, ETH_ALEN);
+	memcpy (p + ETH_ALEN * 2, &type, sizeof (type));
+	if (t)
+		memcpy (p + ETH_HLEN, t->pkt, t->len);
+}
 
-void
-flow_dist_init_same (void)
+static struct rte_mempool *
+flowgen_dpdk_pool (const char * name, int len, struct pkt_tmpl * t)
 {
-	/* throughput of each flow is same */
+	struct rte_mempool * mp;
+
+	mp = rte_pktmbuf_pool_create (name, DPDK_TX_MBUFS * dpdk.txq,
+				      DPDK_CACHE, 0, RTE_PKTMBUF_HEADROOM +
+				      ETH_HLEN + len,
+				      rte_eth_dev_socket_id (dpdk.port));
+	if (!mp) {
+		D ("failed to create mbuf pool %s: %s", name,
+		   rte_strerror (rte_errno));
+		exit (1);
+	}
+	rte_mempool_obj_iter (mp, flowgen_dpdk_prefill, t);
 
-	int n, port = 0;
+	return mp;
+}
 
-	for (n = 0; n < flowgen.flow_num; n++) {
-		flowgen.port_list[n] = flowgen.port_candidates[port++];
+/* xmit pools, after templates are built */
+void
+flowgen_dpdk_tmpl_init (void)
+{
+	int n;
+	char name[RTE_MEMPOOL_NAMESIZE];
+
+	if (flowgen.tmpl_num > DPDK_TMPL_POOLS) {
+		dpdk.tx_pool = flowgen_dpdk_pool ("flowgen_tx", PACKETMAXLEN,
+						  NULL);
+		D ("dpdk %d sizes share a pool, templates are copied",
+		   flowgen.tmpl_num);
+		return;
 	}
 
-	flowgen.port_list_len = n;
-
-	return;
+	for (n = 0; n < flowgen.tmpl_num; n++) {
+		snprintf (name, sizeof (name), "flowgen_tx%d", n);
+		dpdk.tmpl_pool[n] = flowgen_dpdk_pool (name,
+						       flowgen.tmpls[n].len,
+						       &flowgen.tmpls[n]);
+	}
+	dpdk.tmpl_pools = flowgen.tmpl_num;
 }
 
+/* EAL, pools, queues and start of the port, before any thread */
 void
-flow_dist_init_random (void)
+flowgen_dpdk_init (void)
 {
-	/* The ratio of flows is random */
+	int q, socket;
+	u_int16_t rxd = DPDK_DESC, txd = DPDK_DESC;
+	struct rte_eth_conf conf;
+	struct rte_eth_dev_info info;
+	struct rte_ether_addr mac;
+
+	if (rte_eal_init (dpdk.argc, dpdk.argv) < 0) {
+		D ("failed to init EAL: %s", rte_strerror (rte_errno));
+		exit (1);
+	}
 
-	int n, i, plen = 0, port = 0;
-	float sum = 0;
+	if (!rte_eth_dev_is_valid_port (dpdk.port)) {
+		D ("invalid dpdk port %u, %u ports available", dpdk.port,
+		   rte_eth_dev_count_avail ());
+		exit (1);
+	}
 
-	struct flow {
-		float throughput;
-		float ratio;
-	} flows[FLOW_MAX];
-		
+	if (rte_eth_dev_info_get (dpdk.port, &info) != 0) {
+		D ("failed to get info of dpdk port %u", dpdk.port);
+		exit (1);
+	}
 
-	for (n = 0; n < flowgen.flow_num; n++) {
-		flows[n].throughput = rand () % FLOW_MAX;
-		sum += flows[n].throughput;
+	/* unused rx queue of a sender just drops */
+	dpdk.rxq = flowgen.recv_mode ? flowgen.rx_threads : 1;
+	if (dpdk.rxq > info.max_rx_queues) {
+		D ("dpdk port %u has %u rx queues", dpdk.port,
+		   info.max_rx_queues);
+		exit (1);
 	}
 
-	for (n = 0; n < flowgen.flow_num; n++) {
-		flows[n].ratio =
-			(int) (flows[n].throughput / sum * PORTLISTLEN);
-		if (flows[n].ratio == 0)
-			flows[n].ratio = 1;
+	if (dpdk.txq > info.max_tx_queues) {
+		D ("dpdk port %u has %u tx queues", dpdk.port,
+		   info.max_tx_queues);
+		exit (1);
 	}
+	flowgen.xmit_threads = dpdk.txq;
 
-	int psum = 0;
-	for (n = 0; n < flowgen.flow_num; n++) {
+	memset (&conf, 0, sizeof (conf));
+	if (dpdk.rxq > 1) {
+		conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+		conf.rx_adv_conf.rss_conf.rss_hf = info.flow_type_rss_offloads &
+			(RTE_ETH_RSS_IP | RTE_ETH_RSS_UDP);
+	}
 
-		D ("Flow %2d ratio is %f%%", n,
-		   flows[n].ratio / PORTLISTLEN * 100);
-		psum += flows[n].ratio / PORTLISTLEN * 100;
+	if (rte_eth_dev_configure (dpdk.port, dpdk.rxq, dpdk.txq,
+				   &conf) < 0 ||
+	    rte_eth_dev_adjust_nb_rx_tx_desc (dpdk.port, &rxd, &txd) < 0) {
+		D ("failed to configure dpdk port %u", dpdk.port);
+		exit (1);
+	}
 
-		for (i = 0; i < (int)flows[n].ratio; i++) {
-			flowgen.port_list[plen++] =
-				flowgen.port_candidates[port];
-		}
-		port++;
+	rte_eth_macaddr_get (dpdk.port, &mac);
+	memcpy (dpdk.smac, mac.addr_bytes, ETH_ALEN);
+
+	/* xmit pools are created with the templates */
+	socket = rte_eth_dev_socket_id (dpdk.port);
+	dpdk.rx_pool = rte_pktmbuf_pool_create ("flowgen_rx",
+						DPDK_RX_MBUFS * dpdk.rxq,
+						DPDK_CACHE, 0,
+						RTE_MBUF_DEFAULT_BUF_SIZE,
+						socket);
+	if (!dpdk.rx_pool) {
+		D ("failed to create mbuf pool: %s",
+		   rte_strerror (rte_errno));
+		exit (1);
 	}
-	
-	D ("Sum is %d%%, port list len is %d\n", psum, plen);
 
+	for (q = 0; q < dpdk.rxq; q++) {
+		if (rte_eth_rx_queue_setup (dpdk.port, q, rxd, socket, NULL,
+					    dpdk.rx_pool) < 0) {
+			D ("failed to set up rx queue %d", q);
+			exit (1);
+		}
+	}
+	for (q = 0; q < dpdk.txq; q++) {
+		if (rte_eth_tx_queue_setup (dpdk.port, q, txd, socket,
+					    NULL) < 0) {
+			D ("failed to set up tx queue %d", q);
+			exit (1);
+		}
+	}
 
-	flowgen.port_list_len = plen;
+	if (rte_eth_dev_start (dpdk.port) < 0) {
+		D ("failed to start dpdk port %u", dpdk.port);
+		exit (1);
+	}
+	rte_eth_promiscuous_enable (dpdk.port);
 
-	return;
+	D ("dpdk port %u (%s) %02x:%02x:%02x:%02x:%02x:%02x, %d rx and %d tx "
+	   "queues, %u rx and %u tx descriptors", dpdk.port, info.driver_name,
+	   dpdk.smac[0], dpdk.smac[1], dpdk.smac[2], dpdk.smac[3],
+	   dpdk.smac[4], dpdk.smac[5], dpdk.rxq, dpdk.txq, rxd, txd);
+}
+
+static void
+backend_dpdk_open (void)
+{
+	/* the port is started by flowgen_dpdk_init () */
+	flowgen.socket = -1;
+}
+
+/* the frame of a slot is built in an mbuf, so the xmit loop patches
+ * the frame that goes to the NIC */
+static char *
+backend_dpdk_frame (struct tx_batch * b, int i)
+{
+	char * p;
+	struct rte_mbuf * m;
+	struct pkt_tmpl * t = b->slot[i].t;
+	int n = t - flowgen.tmpls;
+
+	m = rte_pktmbuf_alloc (n < dpdk.tmpl_pools ?
+			       dpdk.tmpl_pool[n] : dpdk.tx_pool);
+	if (!m) {
+		__atomic_fetch_add (&dpdk.tx_nombuf, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	p = rte_pktmbuf_mtod_offset (m, char *, ETH_HLEN);
+	if (n >= dpdk.tmpl_pools)
+		memcpy (p, t->pkt, t->len);
+	m->data_len = ETH_HLEN + t->len;
+	m->pkt_len = ETH_HLEN + t->len;
+	b->mbufs[i] = m;
+
+	return p;
+}
+
+static void
+backend_dpdk_prepare (struct tx_batch * b)
+{
+	/* frames are in mbufs already */
+}
+
+static int
+backend_dpdk_submit (struct tx_batch * b)
+{
+	int sent = 0, ret, idle = 0;
+
+	/* wait for room in the tx ring, as sendmmsg blocks */
+	while (sent < b->num && idle < DPDK_TX_RETRY) {
+		ret = rte_eth_tx_burst (dpdk.port, b->queue, b->mbufs + sent,
+					b->num - sent);
+		sent += ret;
+		idle = ret ? 0 : idle + 1;
+	}
+
+	if (sent < b->num)
+		rte_pktmbuf_free_bulk (b->mbufs + sent, b->num - sent);
+
+	return sent;
+}
+
+static void
+backend_dpdk_stats (void)
+{
+	struct rte_eth_stats st;
+
+	if (rte_eth_stats_get (dpdk.port, &st) != 0)
+		return;
+
+	D ("dpdk port %u: tx %lu packets %lu bytes %lu errors %lu no mbufs, "
+	   "rx %lu packets %lu missed %lu no mbufs", dpdk.port,
+	   (unsigned long) st.opackets, (unsigned long) st.obytes,
+	   (unsigned long) st.oerrors, dpdk.tx_nombuf,
+	   (unsigned long) st.ipackets, (unsigned long) st.imissed,
+	   (unsigned long) st.rx_nombuf);
+}
+#endif /* FLOWGEN_DPDK */
+
+static struct flowgen_backend flowgen_backends[] = {
+	[BACKEND_RAW] = {
+		.name		= "raw",
+		.open		= backend_raw_open,
+		.prepare	= backend_raw_prepare,
+		.submit		= backend_sock_submit,
+	},
+	[BACKEND_UDP] = {
+		.name		= "udp",
+		.open		= backend_udp_open,
+		.prepare	= backend_udp_prepare,
+		.submit		= backend_sock_submit,
+	},
+#ifdef FLOWGEN_DPDK
+	[BACKEND_DPDK] = {
+		.name		= "dpdk",
+		.open		= backend_dpdk_open,
+		.frame		= backend_dpdk_frame,
+		.prepare	= backend_dpdk_prepare,
+		.submit		= backend_dpdk_submit,
+		.stats		= backend_dpdk_stats,
+	},
+#endif
+};
+
+void
+flowgen_socket_init (void)
+{
+	int af = flowgen.outer_daddr.af;
+	struct sockaddr_in * sin = (struct sockaddr_in *) &flowgen.dst_sa;
+	struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *) &flowgen.dst_sa;
+
+
+	/* fill sock addr. port must be 0 for ipv6 raw socket */
+	if (af == AF_INET) {
+		sin->sin_addr = flowgen.outer_daddr.v4;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons (DSTPORT);
+		flowgen.dst_salen = sizeof (*sin);
+	} else {
+		sin6->sin6_addr = flowgen.outer_daddr.v6;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = flowgen.udp_mode ? htons (DSTPORT) : 0;
+		flowgen.dst_salen = sizeof (*sin6);
+	}
+
+
+	flowgen_backends[flowgen.backend].open ();
+
+	return;
+}
+
+/*
+ * Packet buffer pool. Templates and xmit batches are carved out of
+ * 2MB chunks, backed by hugepages with -H, so that frames of many
+ * sizes and flows share a few TLB entries. With -N, memory of the
+ * process is bound to the node and threads run on its cpus.
+ */
+
+void *
+flowgen_pool_alloc (size_t size)
+{
+	size_t len;
+	void * p = MAP_FAILED;
+	static int warned = 0;
+	struct pool * pl = &flowgen.pool;
+
+	size = (size + 63) & ~63UL;	/* cache line aligned */
+	if (pl->base && pl->used + size <= pl->len) {
+		p = pl->base + pl->used;
+		pl->used += size;
+		return p;
+	}
+
+	len = (size + POOL_CHUNK - 1) & ~(POOL_CHUNK - 1);
+
+	if (flowgen.hugepage) {
+		p = mmap (NULL, len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			  MAP_POPULATE, -1, 0);
+		if (p == MAP_FAILED && !warned) {
+			D ("no hugepages reserved, "
+			   "use transparent hugepages");
+			warned = 1;
+		}
+	}
+
+	if (p == MAP_FAILED) {
+		if (posix_memalign (&p, POOL_CHUNK, len) != 0) {
+			D ("failed to allocate %lu byte buffer pool", len);
+			exit (1);
+		}
+		if (flowgen.hugepage)
+			madvise (p, len, MADV_HUGEPAGE);
+		/* fault pages in now, on the node of this thread */
+		memset (p, 0, len);
+	}
+
+	pl->base = p;
+	pl->len = len;
+	pl->used = size;
+
+	return p;
+}
+
+/* NODE or the node of interface IFNAME */
+static int
+numa_node_parse (char * str)
+{
+	int node = -1;
+	char path[PATH_MAX];
+	FILE * fp;
+
+	if (str[0] >= '0' && str[0] <= '9')
+		return atoi (str);
+
+	snprintf (path, sizeof (path),
+		  "/sys/class/net/%s/device/numa_node", str);
+	if (!if_nametoindex (str)) {
+		D ("invalid numa node or interface %s", str);
+		exit (1);
+	}
+	if ((fp = fopen (path, "r")) != NULL) {
+		if (fscanf (fp, "%d", &node) != 1)
+			node = -1;
+		fclose (fp);
+	}
+
+	if (node < 0) {
+		/* single node system, or the device does not tell */
+		D ("%s has no numa node, use node 0", str);
+		node = 0;
+	}
+
+	return node;
+}
+
+static void
+numa_node_cpus (int node)
+{
+	int a, b;
+	char path[PATH_MAX], list[4096], * tok, * save;
+	FILE * fp;
+
+	snprintf (path, sizeof (path),
+		  "/sys/devices/system/node/node%d/cpulist", node);
+	if ((fp = fopen (path, "r")) == NULL) {
+		D ("no numa node %d", node);
+		perror ("fopen");
+		exit (1);
+	}
+	if (!fgets (list, sizeof (list), fp))
+		list[0] = '\0';
+	fclose (fp);
+
+	/* "0-3,8-11" */
+	for (tok = strtok_r (list, ",\n", &save); tok;
+	     tok = strtok_r (NULL, ",\n", &save)) {
+		if (sscanf (tok, "%d-%d", &a, &b) != 2)
+			b = a = atoi (tok);
+		for (; a <= b && flowgen.numa_cpu_num < CPU_SETSIZE; a++)
+			flowgen.numa_cpus[flowgen.numa_cpu_num++] = a;
+	}
+
+	if (!flowgen.numa_cpu_num) {
+		D ("numa node %d has no cpu", node);
+		exit (1);
+	}
+}
+
+void
+flowgen_numa_init (void)
+{
+	int n;
+	cpu_set_t set;
+	unsigned long mask[1024 / (8 * sizeof (unsigned long))];
+	int node = flowgen.numa_node;
+
+	numa_node_cpus (node);
+
+	/* threads created after this inherit the cpus and the policy */
+	CPU_ZERO (&set);
+	for (n = 0; n < flowgen.numa_cpu_num; n++)
+		CPU_SET (flowgen.numa_cpus[n], &set);
+	if (sched_setaffinity (0, sizeof (set), &set) < 0) {
+		D ("failed to run on cpus of node %d", node);
+		perror ("sched_setaffinity");
+		exit (1);
+	}
+
+	memset (mask, 0, sizeof (mask));
+	mask[node / (8 * sizeof (unsigned long))] |=
+		1UL << (node % (8 * sizeof (unsigned long)));
+	if (syscall (SYS_set_mempolicy, MPOL_BIND, mask,
+		     sizeof (mask) * 8) < 0) {
+		D ("failed to bind memory to node %d", node);
+		perror ("set_mempolicy");
+		exit (1);
+	}
+
+	if (IS_V())
+		D ("memory on node %d, %d cpus", node, flowgen.numa_cpu_num);
+}
+
+/* pin a worker to a cpu of the node, xmit is 0 */
+void
+flowgen_pin (pthread_t tid, int index)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if (flowgen.numa_node < 0)
+		return;
+
+	cpu = flowgen.numa_cpus[index % flowgen.numa_cpu_num];
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+	if (pthread_setaffinity_np (tid, sizeof (set), &set) != 0)
+		D ("failed to pin worker %d to cpu %d", index, cpu);
+	else if (IS_V())
+		D ("worker %d on cpu %d", index, cpu);
+}
+
+static float size_weight[PACKETMAXLEN + 1];
+
+static void
+size_dist_add (int size, float weight)
+{
+	if (size < PACKETMINLEN || PACKETMAXLEN < size) {
+		D ("packet len must be larger than %d and smaller than %d",
+		   PACKETMINLEN - 1, PACKETMAXLEN + 1);
+		exit (1);
+	}
+	if (weight < 0) {
+		D ("weight of packet size %d must not be negative", size);
+		exit (1);
+	}
+
+	size_weight[size] += weight;
+}
+
+static void
+size_dist_parse_cdf (char * path)
+{
+	/* each line is "SIZE CUMULATIVE-PROBABILITY" in ascending order */
+
+	FILE * fp;
+	char line[256];
+	int size;
+	float cdf, prev = 0;
+
+	if ((fp = fopen (path, "r")) == NULL) {
+		D ("failed to open cdf file %s", path);
+		perror ("fopen");
+		exit (1);
+	}
+
+	while (fgets (line, sizeof (line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf (line, "%d %f", &size, &cdf) != 2) {
+			D ("invalid line in %s: %s", path, line);
+			exit (1);
+		}
+		if (cdf < prev) {
+			D ("cdf in %s must be increasing: %s", path, line);
+			exit (1);
+		}
+
+		size_dist_add (size, cdf - prev);
+		prev = cdf;
+	}
+
+	fclose (fp);
+}
+
+void
+flowgen_size_dist_init (void)
+{
+	char * spec = flowgen.size_spec, * tok, * save;
+	int n, i, min, max, size, ratio, slen = 0;
+	float weight, sum = 0;
+
+	if (!spec) {
+		size_dist_add (DEFAULT_PACKETLEN, 1);
+	} else if (strcmp (spec, "imix") == 0) {
+		/* simple imix, 64 (78 for ipv6), 594 and 1518 byte frames */
+		size_dist_add (flowgen.saddr.af == AF_INET ? 46 : 60, 7);
+		size_dist_add (576, 4);
+		size_dist_add (1500, 1);
+	} else if (strncmp (spec, "cdf:", 4) == 0) {
+		size_dist_parse_cdf (spec + 4);
+	} else if (sscanf (spec, "%d-%d", &min, &max) == 2) {
+		if (min > max) {
+			D ("invalid packet size range %s", spec);
+			exit (1);
+		}
+		for (size = min; size <= max; size++)
+			size_dist_add (size, 1);
+	} else {
+		for (tok = strtok_r (spec, ",", &save); tok;
+		     tok = strtok_r (NULL, ",", &save)) {
+			weight = 1;
+			if (sscanf (tok, "%d:%f", &size, &weight) < 1) {
+				D ("invalid packet size %s", tok);
+				exit (1);
+			}
+			size_dist_add (size, weight);
+		}
+	}
+
+	for (size = 0; size <= PACKETMAXLEN; size++) {
+		if (size_weight[size] > 0) {
+			flowgen.tmpls[flowgen.tmpl_num++].len = size;
+			sum += size_weight[size];
+		}
+	}
+
+	if (sum == 0) {
+		D ("no packet size in %s", spec);
+		exit (1);
+	}
+
+	/* fill size list following the weight of each size */
+	for (n = 0; n < flowgen.tmpl_num; n++) {
+		size = flowgen.tmpls[n].len;
+		ratio = (int) (size_weight[size] / sum * SIZELISTLEN);
+		if (ratio == 0)
+			ratio = 1;
+		if (slen + ratio > SIZELISTLEN) {
+			D ("size list is full, size %d and larger are "
+			   "less frequent than specified", size);
+			ratio = SIZELISTLEN - slen;
+		}
+
+		if (flowgen.tmpl_num <= 16)
+			D ("Size %4d ratio is %f%%", size,
+			   (float) ratio / SIZELISTLEN * 100);
+
+		for (i = 0; i < ratio; i++)
+			flowgen.size_list[slen++] = n;
+	}
+
+	if (flowgen.tmpl_num > 16)
+		D ("%d sizes from %d to %d", flowgen.tmpl_num,
+		   flowgen.tmpls[0].len,
+		   flowgen.tmpls[flowgen.tmpl_num - 1].len);
+
+	flowgen.size_list_len = slen;
+
+	return;
+}
+
+void
+flowgen_encap_parse (char * spec)
+{
+	int n;
+	char * arg, * tok, * save;
+	u_int32_t min, max;
+
+	if ((arg = strchr (spec, ':')) != NULL)
+		*arg++ = '\0';
+
+	if (strcmp (spec, "vxlan") == 0) {
+		flowgen.encap = ENCAP_VXLAN;
+		flowgen.encap_key = 1;
+		flowgen.encap_key_min = flowgen.encap_key_max = 1;
+	} else if (strcmp (spec, "gre") == 0) {
+		flowgen.encap = ENCAP_GRE;
+	} else if (strcmp (spec, "ipip") == 0) {
+		flowgen.encap = ENCAP_IPIP;
+		return;
+	} else if (strcmp (spec, "mpls") == 0) {
+		flowgen.encap = ENCAP_MPLS;
+		if (!arg) {
+			D ("mpls needs at least one label");
+			exit (1);
+		}
+		for (tok = strtok_r (arg, "/", &save); tok;
+		     tok = strtok_r (NULL, "/", &save)) {
+			n = flowgen.mpls_label_num;
+			if (n == MPLS_LABEL_MAX) {
+				D ("max number of mpls labels is %d",
+				   MPLS_LABEL_MAX);
+				exit (1);
+			}
+			flowgen.mpls_label[n] = strtoul (tok, NULL, 0);
+			if (flowgen.mpls_label[n] > 0xFFFFF) {
+				D ("invalid mpls label %s", tok);
+				exit (1);
+			}
+			flowgen.mpls_label_num++;
+		}
+		return;
+	} else {
+		D ("invalid encapsulation type %s", spec);
+		exit (1);
+	}
+
+	if (!arg)
+		return;
+
+	/* vni or gre key range */
+	n = sscanf (arg, "%u-%u", &min, &max);
+	if (n < 1) {
+		D ("invalid key %s", arg);
+		exit (1);
+	}
+	if (n == 1)
+		max = min;
+	if (min > max ||
+	    (flowgen.encap == ENCAP_VXLAN && max > 0xFFFFFF)) {
+		D ("invalid key range %s", arg);
+		exit (1);
+	}
+
+	flowgen.encap_key = 1;
+	flowgen.encap_key_min = min;
+	flowgen.encap_key_max = max;
+
+	return;
+}
+
+/* length of outer headers in front of the flow ip header */
+int
+flowgen_encap_len (void)
+{
+	int iplen = iphdr_len (flowgen.outer_daddr.af);
+
+	switch (flowgen.encap) {
+	case ENCAP_VXLAN :
+		return iplen + sizeof (struct udphdr) +
+			8 + 14;		/* vxlan and inner ether */
+	case ENCAP_GRE :
+		return iplen + 4 + (flowgen.encap_key ? 4 : 0);
+	case ENCAP_IPIP :
+		return iplen;
+	case ENCAP_MPLS :
+		return iplen + sizeof (struct udphdr) +
+			4 * flowgen.mpls_label_num;
+	}
+
+	return 0;
+}
+
+static char *
+ip_build (char * p, int len, int proto, struct addr * src, struct addr * dst)
+{
+	struct ip * ip = (struct ip *) p;
+	struct ip6_hdr * ip6 = (struct ip6_hdr *) p;
+
+	if (src->af == AF_INET6) {
+		ip6->ip6_flow	= htonl (6 << 28 | IPTOS_LOWDELAY << 20);
+		ip6->ip6_plen	= htons (len - sizeof (*ip6));
+		ip6->ip6_nxt	= proto;
+		ip6->ip6_hlim	= 16;
+		ip6->ip6_src	= src->v6;
+		ip6->ip6_dst	= dst->v6;
+
+		return p + sizeof (*ip6);
+	}
+
+	ip->ip_v	= IPVERSION;
+	ip->ip_hl	= 5;
+	ip->ip_id	= 0;
+	ip->ip_tos	= IPTOS_LOWDELAY;
+	ip->ip_len	= htons (len);
+	ip->ip_off	= 0;
+	ip->ip_ttl	= 16;
+	ip->ip_p	= proto;
+	ip->ip_dst	= dst->v4;
+	ip->ip_src	= src->v4;
+	ip->ip_sum	= 0;
+	ip->ip_sum	= wrapsum (checksum (ip, sizeof (*ip), 0));
+
+	return p + sizeof (*ip);
+}
+
+static char *
+udp_build (char * p, int len, int sport, int dport)
+{
+	struct udphdr * udp = (struct udphdr *) p;
+
+	udp->uh_sport	= htons (sport);
+	udp->uh_dport	= htons (dport);
+	udp->uh_ulen	= htons (len);
+	udp->uh_sum	= 0;
+
+	return p + sizeof (*udp);
+}
+
+/* udp checksum of pseudo header, udp header and payload */
+static u_int32_t
+udp_sum (struct addr * src, struct addr * dst, char * udp, int len)
+{
+	u_int32_t sum;
+
+	sum = checksum (&src->v6, addr_len (src), 0);
+	sum = checksum (&dst->v6, addr_len (dst), sum);
+	sum = checksum (udp, len, sum);
+	sum = csum_add (sum, IPPROTO_UDP);
+	sum = csum_add (sum, len);
+
+	return sum;
+}
+
+static char *
+flowgen_encap_build (struct pkt_tmpl * t)
+{
+	int n, s, v6 = (flowgen.saddr.af == AF_INET6);
+	char * p = t->pkt;
+	u_int32_t label;
+	u_int16_t gre[2];
+	struct addr * src = &flowgen.outer_saddr, * dst = &flowgen.outer_daddr;
+	int iplen = iphdr_len (dst->af);
+	u_int8_t ether[14] = {
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x02,	/* dst mac */
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x01,	/* src mac */
+		0x08, 0x00,				/* ipv4 */
+	};
+
+	/* entropy source port and keys are patched per flow */
+	switch (flowgen.encap) {
+	case ENCAP_VXLAN :
+		p = ip_build (p, t->len, IPPROTO_UDP, src, dst);
+		t->entropy_off = p - t->pkt;
+		p = udp_build (p, t->len - iplen, 0, VXLANPORT);
+		p[0] = 0x08;		/* I flag, vni is valid */
+		t->key_off = p + 4 - t->pkt;
+		p += 8;
+		if (v6)
+			ether[12] = 0x86, ether[13] = 0xDD;
+		memcpy (p, ether, sizeof (ether));
+		p += sizeof (ether);
+		break;
+
+	case ENCAP_GRE :
+		p = ip_build (p, t->len, IPPROTO_GRE, src, dst);
+		gre[0] = htons (flowgen.encap_key ? 0x2000 : 0); /* K bit */
+		gre[1] = htons (v6 ? 0x86DD : 0x0800);
+		memcpy (p, gre, sizeof (gre));
+		p += sizeof (gre);
+		if (flowgen.encap_key) {
+			t->key_off = p - t->pkt;
+			p += 4;
+		}
+		break;
+
+	case ENCAP_IPIP :
+		p = ip_build (p, t->len, v6 ? IPPROTO_IPV6 : IPPROTO_IPIP,
+			      src, dst);
+		break;
+
+	case ENCAP_MPLS :
+		p = ip_build (p, t->len, IPPROTO_UDP, src, dst);
+		t->entropy_off = p - t->pkt;
+		p = udp_build (p, t->len - iplen, 0, MPLSUDPPORT);
+		for (n = 0; n < flowgen.mpls_label_num; n++) {
+			s = (n == flowgen.mpls_label_num - 1);
+			label = htonl (flowgen.mpls_label[n] << 12 |
+				       s << 8 | 64);
+			memcpy (p, &label, sizeof (label));
+			p += sizeof (label);
+		}
+		break;
+	}
+
+	return p;
+}
+
+void
+flowgen_tmpl_init (struct pkt_tmpl * t)
+{
+	int len, iplen = iphdr_len (flowgen.saddr.af);
+	char * ip, * udp;
+	struct flowgen_hdr hdr;
+
+	/* outer headers are written before the flow headers fit */
+	len = flowgen_encap_len () + iplen + (int) sizeof (struct udphdr);
+	if (t->len < len) {
+		D ("packet len %d is too short, %d at least", t->len, len);
+		exit (1);
+	}
+
+	t->pkt = flowgen_pool_alloc (t->len);
+
+	/* fill outer headers */
+	t->inner = flowgen_encap_build (t) - t->pkt;
+	len = t->len - t->inner;
+
+	/* fill ip header */
+	ip = t->pkt + t->inner;
+	udp = ip_build (ip, len, IPPROTO_UDP, &flowgen.saddr, &flowgen.daddr);
+	if (flowgen.saddr.af == AF_INET6)
+		t->label_word = ntohl (((struct ip6_hdr *) ip)->ip6_flow);
+
+	/* fill udp header, source port is filled when xmitted */
+	t->udp = udp - t->pkt;
+	udp_build (udp, len - iplen, 0, DSTPORT);
+
+	/* sequence and time are filled when xmitted */
+	if (flowgen.tstamp && len - iplen >=
+	    sizeof (struct udphdr) + sizeof (struct flowgen_hdr)) {
+		hdr.magic = htonl (FLOWGEN_MAGIC);
+		t->hdr_off = t->udp + sizeof (struct udphdr);
+		memcpy (t->pkt + t->hdr_off, &hdr.magic, sizeof (hdr.magic));
+	}
+
+	/* source port is added to the checksum when xmitted. */
+	t->csum = udp_sum (&flowgen.saddr, &flowgen.daddr, udp, len - iplen);
+
+	/* ipv6 does not allow zero udp checksum for tunnels either.
+	 * flow fields are still zero here and added when xmitted. */
+	if (t->entropy_off && flowgen.outer_daddr.af == AF_INET6) {
+		t->outer_csum_off = t->entropy_off + 6;
+		t->outer_csum = udp_sum (&flowgen.outer_saddr,
+					 &flowgen.outer_daddr,
+					 t->pkt + t->entropy_off,
+					 t->len - t->entropy_off);
+	}
+
+	return;
+}
+
+void
+flowgen_packet_init (void)
+{
+	int n;
+
+	for (n = 0; n < flowgen.tmpl_num; n++)
+		flowgen_tmpl_init (&flowgen.tmpls[n]);
+
+	return;
+};
+
+/* picks a template following the size list in O(1) */
+struct size_picker {
+	int		idx;
+	u_int32_t	buf[SIZEBATCH];
+	struct fastrand	rnd;
+};
+
+static void
+size_picker_init (struct size_picker * sp, int index)
+{
+	fastrand_init (&sp->rnd, flowgen.seed, index);
+	sp->idx = SIZEBATCH;
+}
+
+static inline struct pkt_tmpl *
+size_picker_next (struct size_picker * sp)
+{
+	if (sp->idx == SIZEBATCH) {
+		fastrand_fill_range (&sp->rnd, sp->buf, SIZEBATCH,
+				     flowgen.size_list_len);
+		sp->idx = 0;
+	}
+
+	return &flowgen.tmpls[flowgen.size_list[sp->buf[sp->idx++]]];
+}
+
+/* microsoft's default rss key, also the default of most nics */
+static const u_int8_t rss_default_key[RSS_KEY_LEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+void
+flowgen_rss_parse (char * spec)
+{
+	int n, i;
+	char * tok, * save, * p, * w;
+
+	flowgen.rss_indir_len = RSS_INDIR_LEN;
+	memcpy (flowgen.rss_key, rss_default_key, RSS_KEY_LEN);
+
+	tok = strtok_r (spec, ",", &save);
+	flowgen.rss_queues = tok ? atoi (tok) : 0;
+	if (flowgen.rss_queues < 1 || RSS_QUEUE_MAX < flowgen.rss_queues) {
+		D ("rss queues must be 1 to %d", RSS_QUEUE_MAX);
+		exit (1);
+	}
+	for (n = 0; n < flowgen.rss_queues; n++)
+		flowgen.rss_weight[n] = 1;
+
+	while ((tok = strtok_r (NULL, ",", &save)) != NULL) {
+		if (strncmp (tok, "indir=", 6) == 0) {
+			flowgen.rss_indir_len = atoi (tok + 6);
+			if (flowgen.rss_indir_len < flowgen.rss_queues) {
+				D ("indirection table is smaller than queues");
+				exit (1);
+			}
+		} else if (strncmp (tok, "key=", 4) == 0) {
+			/* "6d:5a:..." as ethtool -x shows, or "6d5a..." */
+			for (p = tok + 4, n = 0; *p && n < RSS_KEY_LEN; p++) {
+				if (*p == ':')
+					continue;
+				if (sscanf (p, "%2hhx", &flowgen.rss_key[n++])
+				    != 1)
+					break;
+				p++;
+			}
+			if (n != RSS_KEY_LEN) {
+				D ("rss key must be %d bytes", RSS_KEY_LEN);
+				exit (1);
+			}
+		} else if (strncmp (tok, "weights=", 8) == 0) {
+			/* queues not in the list get no flows */
+			p = tok + 8;
+			for (n = 0; n < flowgen.rss_queues; n++) {
+				w = strsep (&p, "/");
+				flowgen.rss_weight[n] = w ? atof (w) : 0;
+			}
+		} else {
+			D ("invalid rss option %s", tok);
+			exit (1);
+		}
+	}
+
+	for (n = 0, i = 0; n < flowgen.rss_queues; n++)
+		i += (flowgen.rss_weight[n] > 0);
+	if (i == 0) {
+		D ("all rss queue weights are zero");
+		exit (1);
+	}
+
+	return;
+}
+
+static u_int32_t
+toeplitz_hash (const u_int8_t * key, const u_int8_t * data, int len)
+{
+	int i, b;
+	u_int32_t hash = 0, v;
+
+	v = key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v <<= 1;
+			if (key[i + 4] & (1 << b))
+				v |= 1;
+		}
+	}
+
+	return hash;
+}
+
+/* outer udp source port from the inner flow, RFC 7348 */
+static u_int16_t
+flow_entropy (u_int16_t sport, u_int32_t label)
+{
+	u_int64_t h;
+
+	h = fastrand_mix64 (addr_hash (&flowgen.daddr) ^
+			    ((u_int64_t) label << 16 | sport));
+
+	return htons (49152 | (h & 0x3FFF));
+}
+
+/* rx queue of a flow, hashing the tuple the receiver sees */
+static int
+flowgen_rss_queue (u_int16_t sport)
+{
+	int len;
+	u_int8_t in[36];
+	u_int16_t ports[2];
+	struct addr * src = &flowgen.saddr, * dst = &flowgen.daddr;
+
+	ports[0] = htons (sport);
+	ports[1] = htons (DSTPORT);
+
+	if (flowgen.encap == ENCAP_VXLAN || flowgen.encap == ENCAP_MPLS) {
+		src = &flowgen.outer_saddr;
+		dst = &flowgen.outer_daddr;
+		ports[0] = flow_entropy (sport, 0);
+		ports[1] = htons (flowgen.encap == ENCAP_VXLAN ?
+				  VXLANPORT : MPLSUDPPORT);
+	}
+
+	len = addr_len (src);
+	memcpy (in, &src->v6, len);
+	memcpy (in + len, &dst->v6, len);
+	memcpy (in + len * 2, ports, sizeof (ports));
+
+	/* default indirection table of linux is i % queues */
+	return toeplitz_hash (flowgen.rss_key, in, len * 2 + sizeof (ports))
+		% flowgen.rss_indir_len % flowgen.rss_queues;
+}
+
+void
+flowgen_rss_port_init (void)
+{
+	int n, q, target, tries;
+	int assigned[RSS_QUEUE_MAX] = { 0 };
+	int active[RSS_QUEUE_MAX] = { 0 };	/* assigned out of -n */
+	float sum = 0, deficit, max;
+	u_int16_t candidate, next = SRCPORT_START;
+	static u_int8_t used[SRCPORT_MAX + 1];
+
+	if (flowgen.encap == ENCAP_GRE || flowgen.encap == ENCAP_IPIP) {
+		D ("rss of gre and ipip does not depend on ports");
+		exit (1);
+	}
+	if (flowgen.encap && flowgen.label_num > 1) {
+		D ("rss with flow labels needs no udp encapsulation");
+		exit (1);
+	}
+
+	for (q = 0; q < flowgen.rss_queues; q++)
+		sum += flowgen.rss_weight[q];
+
+	for (n = 0; n < flowgen.flow_cap; n++) {
+
+		/* the queue most behind its share takes the next flow */
+		target = 0;
+		max = -flowgen.flow_cap;
+		for (q = 0; q < flowgen.rss_queues; q++) {
+			deficit = flowgen.rss_weight[q] / sum * (n + 1) -
+				assigned[q];
+			if (flowgen.rss_weight[q] > 0 && deficit > max) {
+				max = deficit;
+				target = q;
+			}
+		}
+
+		/* search a source port landing on the target queue */
+		for (tries = 0; tries < SRCPORT_MAX; tries++) {
+			if (flowgen.randomized) {
+				candidate = SRCPORT_START +
+					fastrand_range (&flowgen.rnd,
+							SRCPORT_MAX -
+							SRCPORT_START);
+			} else {
+				candidate = next++;
+				if (next > SRCPORT_MAX)
+					next = SRCPORT_START;
+			}
+			if (!used[candidate] &&
+			    flowgen_rss_queue (candidate) == target)
+				break;
+		}
+		if (tries == SRCPORT_MAX) {
+			D ("no source port reaches rx queue %d", target);
+			exit (1);
+		}
+
+		used[candidate] = 1;
+		assigned[target]++;
+		flowgen.flows[n].sport = candidate;
+		if (n < flowgen.flow_num) {
+			active[target]++;
+			D ("Flow %2d is src port %d, rx queue %d", n,
+			   candidate, target);
+		}
+	}
+
+	for (q = 0; q < flowgen.rss_queues; q++)
+		D ("RX queue %3d has %d flows", q, active[q]);
+
+	return;
+}
+
+void
+flowgen_port_candidates_init (void)
+{
+	int n, i, candidate;
+
+	if (flowgen.rss_queues) {
+		flowgen_rss_port_init ();
+		return;
+	}
+	
+	if (!flowgen.randomized) {
+		for (n = 0; n < flowgen.flow_cap; n++) {
+			flowgen.flows[n].sport = SRCPORT_START + n;
+			if (n < flowgen.flow_num)
+				D ("Flow %2d is src port %d", n,
+				   flowgen.flows[n].sport);
+		}
+		return;
+	}
+
+	/* randomize udp source port  */
+	for (n = 0; n < flowgen.flow_cap; n++) {
+		while (1) {
+			candidate = SRCPORT_START +
+				fastrand_range (&flowgen.rnd,
+						SRCPORT_MAX - SRCPORT_START);
+			for (i = 0; i < n; i++) {
+				if (flowgen.flows[i].sport == candidate)
+					break;
+			}
+			if (i == n)
+				break;
+		}
+		flowgen.flows[n].sport = candidate;
+		if (n < flowgen.flow_num)
+			D ("Flow %2d is src port %d", n, candidate);
+	}
+
+	return;
+}
+
+
+void
+flowgen_flow_init (void)
+{
+	int n;
+	u_int32_t key, range;
+	struct flow * f;
+
+	/* each source port carries label_num flow labels */
+	if (flowgen.label_num > 1) {
+		for (n = flowgen.flow_cap * flowgen.label_num - 1;
+		     n >= 0; n--) {
+			flowgen.flows[n].sport =
+				flowgen.flows[n / flowgen.label_num].sport;
+			flowgen.flows[n].label = n % flowgen.label_num + 1;
+		}
+		flowgen.flow_num *= flowgen.label_num;
+		flowgen.flow_cap *= flowgen.label_num;
+		D ("%d flows with %d flow labels for each port",
+		   flowgen.flow_num, flowgen.label_num);
+	}
+
+	range = flowgen.encap_key_max - flowgen.encap_key_min + 1;
+
+	for (n = 0; n < flowgen.flow_cap; n++) {
+		f = &flowgen.flows[n];
+
+		f->entropy = flow_entropy (f->sport, f->label);
+
+		key = flowgen.encap_key_min + n % range;
+		f->key = htonl (flowgen.encap == ENCAP_VXLAN ?
+				key << 8 : key);
+
+		if (flowgen.encap && flowgen.encap_key && n < flowgen.flow_num)
+			D ("Flow %2d is key %u", n, key);
+	}
+
+	return;
+}
+
+void
+flow_dist_init_same (struct flowgen_conf * c)
+{
+	/* throughput of each flow is same */
+
+	int n, port = 0;
+
+	for (n = 0; n < c->flow_num; n++) {
+		c->flow_list[n] = port++;
+	}
+
+	c->flow_list_len = n;
+
+	return;
+}
+
+void
+flow_dist_init_random (struct flowgen_conf * c)
+{
+	/* The ratio of flows is random */
+
+	int n, i, plen = 0, port = 0;
+	float sum = 0;
+
+	struct flow {
+		float throughput;
+		float ratio;
+	} flows[FLOW_MAX];
+		
+
+	for (n = 0; n < c->flow_num; n++) {
+		flows[n].throughput = fastrand_range (&flowgen.rnd, FLOW_MAX);
+		sum += flows[n].throughput;
+	}
+
+	for (n = 0; n < c->flow_num; n++) {
+		flows[n].ratio =
+			(int) (flows[n].throughput / sum * PORTLISTLEN);
+		if (flows[n].ratio == 0)
+			flows[n].ratio = 1;
+	}
+
+	int psum = 0;
+	for (n = 0; n < c->flow_num; n++) {
+
+		if (!flowgen.conf)	/* quiet on runtime changes */
+			D ("Flow %2d ratio is %f%%", n,
+			   flows[n].ratio / PORTLISTLEN * 100);
+		psum += flows[n].ratio / PORTLISTLEN * 100;
+
+		for (i = 0; i < (int)flows[n].ratio; i++) {
+			c->flow_list[plen++] = port;
+		}
+		port++;
+	}
+	
+	if (!flowgen.conf)
+		D ("Sum is %d%%, port list len is %d\n", psum, plen);
+
+
+	c->flow_list_len = plen;
+
+	return;
+}
+
+void
+flow_dist_init_power (struct flowgen_conf * c)
+{
+
+	/* The ratio of lows follows Power Law */
+
+	int n, i, plen = 0, port = 0;
+	float sum = 0;
+
+	struct flow {
+		float throughput;
+		float ratio;
+	} flows[FLOW_MAX];
+		
+
+	for (n = 0; n < c->flow_num; n++) {
+		flows[n].throughput = POWERLAW (n);
+		sum += flows[n].throughput;
+	}
+
+	for (n = 0; n < c->flow_num; n++) {
+		flows[n].ratio =
+			(int) (flows[n].throughput / sum * PORTLISTLEN);
+		if (flows[n].ratio == 0)
+			flows[n].ratio = 1;
+	}
+
+	int psum = 0;
+	for (n = 0; n < c->flow_num; n++) {
+
+		if (!flowgen.conf)	/* quiet on runtime changes */
+			D ("Flow %2d ratio is %f%%", n,
+			   flows[n].ratio / PORTLISTLEN * 100);
+		psum += flows[n].ratio / PORTLISTLEN * 100;
+
+		for (i = 0; i < (int)flows[n].ratio; i++) {
+			c->flow_list[plen++] = port;
+		}
+		port++;
+	}
+	
+	if (!flowgen.conf)
+		D ("Sum is %d%%, port list len is %d\n", psum, plen);
+
+	c->flow_list_len = plen;
+
+	return;
+
+}
+
+/* features of an xmit loop. each combination is a specialized loop */
+#define TX_COUNTED	0x01	/* -c */
+#define TX_PACED	0x02	/* -i or rate */
+#define TX_VERBOSE	0x04	/* -v */
+#define TX_STAMPED	0x08	/* -a */
+#define TX_BURST	0x10	/* -B */
+#define TX_TXTIME	0x20	/* -j */
+#define TX_LOOP_NUM	0x40
+
+/* xmit state kept across config changes */
+struct tx_state {
+	int		index;		/* of the xmit thread */
+	int		stride;		/* xmit threads sharing the flow list */
+	int		n;		/* position in flow list */
+	int		done;		/* -c packets sent */
+	unsigned long	remain;		/* packets to be sent with -c */
+	u_int64_t	last;		/* deadline of the last packet */
+	u_int64_t	gap;		/* nsec to the next packet */
+	u_int64_t	tick;		/* next evaluation of profile */
+	u_int64_t	first;		/* departure of the batch, -j */
+	u_int64_t	burst_start;	/* of the current burst */
+	unsigned long	burst_len;	/* packets in the current burst */
+	unsigned long	burst_left;
+	struct fastrand	rnd;		/* for bursts */
+	struct size_picker sp;
+	struct tx_batch	* b;
+};
+
+static inline u_int64_t
+nsec_mono (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Profiling (make PROF=yes). Threads mark the end of each stage of their
+ * loop, and the time since the previous mark goes to that stage: cycles
+ * from rdtsc on x86, nsec of CLOCK_MONOTONIC elsewhere. Marks are per
+ * batch, except that template copy and header rewrite are marked per
+ * packet. Every thread has its own counters and a log2 histogram of each
+ * stage, printed at exit and on SIGUSR1. Without PROF the marks compile
+ * to nothing.
+ */
+#ifdef FLOWGEN_PROF
+
+#if defined (__x86_64__) || defined (__i386__)
+#define PROF_UNIT	"cycles"
+#define prof_clock()	__rdtsc ()
+#else
+#define PROF_UNIT	"nsec"
+#define prof_clock()	nsec_mono ()
+#endif
+
+#define PROF_BUCKETS	64
+
+enum {
+	PROF_PACE,	/* loop control, pacing sleeps and profile */
+	PROF_BUILD,	/* pick a flow and a size, copy the template */
+	PROF_PATCH,	/* rewrite headers and checksums */
+	PROF_SEND,	/* backend prepare, syscall and reap */
+	PROF_ACCT,	/* counters */
+	PROF_RX_WAIT,	/* poll for a ring block */
+	PROF_RX_RECV,	/* recv syscall */
+	PROF_RX_PARSE,	/* parse, rtt and reflect a ring block */
+	PROF_STAGES,
+};
+
+static const char * prof_stage_name[PROF_STAGES] = {
+	"pace", "build", "patch", "send", "acct",
+	"rx wait", "rx recv", "rx parse",
+};
+
+struct prof_stat {
+	const char	* name;		/* and index of the thread */
+	int		index;
+	u_int64_t	last;		/* clock of the previous mark */
+	u_int64_t	clock[PROF_STAGES];
+	unsigned long	calls[PROF_STAGES];
+	unsigned long	packets[PROF_STAGES];
+	unsigned long	hist[PROF_STAGES][PROF_BUCKETS];
+	struct prof_stat * next;
+};
+
+static struct prof_stat * prof_list;
+static __thread struct prof_stat * prof;
+static u_int64_t prof_clock0, prof_nsec0;
+
+static void
+prof_start (const char * name, int index)
+{
+	if (!prof) {
+		prof = calloc (1, sizeof (*prof));
+		if (!prof) {
+			perror ("calloc");
+			exit (1);
+		}
+		prof->name = name;
+		prof->index = index;
+		prof->next = __atomic_load_n (&prof_list, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n (&prof_list, &prof->next,
+						     prof, 0, __ATOMIC_RELEASE,
+						     __ATOMIC_RELAXED))
+			;
+	}
+	prof->last = prof_clock ();
+}
+
+static inline void
+prof_mark (int stage, unsigned long pkts)
+{
+	u_int64_t now = prof_clock (), d = now - prof->last;
+
+	prof->clock[stage] += d;
+	prof->calls[stage]++;
+	prof->packets[stage] += pkts;
+	prof->hist[stage][63 - __builtin_clzll (d | 1)]++;
+	prof->last = now;
+}
+
+/* upper bound of the bucket at pct percent of calls */
+static u_int64_t
+prof_percentile (unsigned long * hist, unsigned long calls, double pct)
+{
+	int b;
+	unsigned long n = 0;
+
+	for (b = 0; b < PROF_BUCKETS - 1; b++) {
+		n += hist[b];
+		if (n >= calls * pct / 100)
+			break;
+	}
+
+	return (2ULL << b) - 1;
+}
+
+static void
+flowgen_prof_print (void)
+{
+	int s;
+	u_int64_t total;
+	unsigned long pkts;
+	struct prof_stat * p;
+
+	D ("profile in %s, %.3f per nsec", PROF_UNIT,
+	   (double) (prof_clock () - prof_clock0) /
+	   (nsec_mono () - prof_nsec0));
+
+	for (p = __atomic_load_n (&prof_list, __ATOMIC_ACQUIRE); p;
+	     p = p->next) {
+		for (s = 0, total = 0, pkts = 0; s < PROF_STAGES; s++) {
+			total += p->clock[s];
+			if (p->packets[s] > pkts)
+				pkts = p->packets[s];
+		}
+		if (!total)
+			continue;
+
+		printf ("%s %d: %lu packets, %.1f %s per packet\n", p->name,
+			p->index, pkts, pkts ? (double) total / pkts : 0, PROF_UNIT);
+		printf ("  %-9s %6s %10s %12s %10s %10s %10s\n", "stage",
+			"%", "per pkt", "calls", "per call", "p50", "p99");
+		for (s = 0; s < PROF_STAGES; s++) {
+			if (!p->calls[s])
+				continue;
+			printf ("  %-9s %6.2f %10.1f %12lu %10.1f %10lu "
+				"%10lu\n", prof_stage_name[s],
+				p->clock[s] * 100.0 / total,
+				pkts ? (double) p->clock[s] / pkts : 0,
+				p->calls[s],
+				(double) p->clock[s] / p->calls[s],
+				prof_percentile (p->hist[s], p->calls[s], 50),
+				prof_percentile (p->hist[s], p->calls[s], 99));
+		}
+	}
+	fflush (stdout);
+}
+
+/* print the profile on SIGUSR1 */
+static void *
+flowgen_prof_thread (void * param)
+{
+	int sig;
+	sigset_t * set = param;
+
+	while (sigwait (set, &sig) == 0)
+		flowgen_prof_print ();
+
+	return NULL;
+}
+
+/* before other threads start, so that they inherit the blocked signal */
+static void
+flowgen_prof_init (void)
+{
+	pthread_t tid;
+	static sigset_t set;
+
+	prof_clock0 = prof_clock ();
+	prof_nsec0 = nsec_mono ();
+
+	sigemptyset (&set);
+	sigaddset (&set, SIGUSR1);
+	pthread_sigmask (SIG_BLOCK, &set, NULL);
+	pthread_create (&tid, NULL, flowgen_prof_thread, &set);
+	pthread_detach (tid);
+}
+
+#define PROF_START(name, index)	prof_start (name, index)
+#define PROF_MARK(stage, pkts)	prof_mark (stage, pkts)
+
+#else /* FLOWGEN_PROF */
+
+#define PROF_START(name, index)
+#define PROF_MARK(stage, pkts)
+
+#endif /* FLOWGEN_PROF */
+
+static inline void
+pace_until (u_int64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* pace_until () for xmit, but wake as soon as the config c is replaced.
+ * returns 1 when it was. */
+static inline int
+pace_conf (struct flowgen_conf * c, u_int64_t deadline)
+{
+	u_int32_t gen;
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+
+	do {
+		gen = __atomic_load_n (&flowgen.conf_gen, __ATOMIC_SEQ_CST);
+		if (c != __atomic_load_n (&flowgen.conf, __ATOMIC_SEQ_CST))
+			return 1;
+		/* absolute timeout on CLOCK_MONOTONIC */
+		if (syscall (SYS_futex, &flowgen.conf_gen,
+			     FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, gen,
+			     &ts, NULL, FUTEX_BITSET_MATCH_ANY) < 0 &&
+		    errno == ETIMEDOUT)
+			return 0;
+	} while (nsec_mono () < deadline);
+
+	return c != __atomic_load_n (&flowgen.conf, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Load profiles. A profile gives the target rate, and optionally the
+ * number of flows, as a function of time since it started.
+ */
+
+static int
+profile_load_file (struct flowgen_profile * p, char * path)
+{
+	int n = 0, ret;
+	char buf[256];
+	FILE * fp;
+	struct profile_point * pt;
+
+	if ((fp = fopen (path, "r")) == NULL) {
+		perror ("fopen");
+		return -1;
+	}
+
+	while (fgets (buf, sizeof (buf), fp)) {
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+
+		if (n == PROFILE_POINT_MAX) {
+			D ("more than %d points in %s", PROFILE_POINT_MAX,
+			   path);
+			fclose (fp);
+			return -1;
+		}
+
+		pt = &p->points[n];
+		pt->flows = 0;
+		ret = sscanf (buf, "%lf,%lf,%d", &pt->sec, &pt->pps,
+			      &pt->flows);
+		if (ret < 2 || pt->pps < 0 ||
+		    (n > 0 && pt->sec < p->points[n - 1].sec)) {
+			D ("invalid line in %s: %s", path, buf);
+			fclose (fp);
+			return -1;
+		}
+		n++;
+	}
+	fclose (fp);
+
+	if (n == 0) {
+		D ("no point in %s", path);
+		return -1;
+	}
+
+	p->point_num = n;
+
+	return 0;
+}
+
+/* parse SHAPE:LO-HI:...[,flows=LO-HI] or file:PATH. NULL on error */
+struct flowgen_profile *
+flowgen_profile_parse (char * spec)
+{
+	int ret = 0;
+	char * fl;
+	struct flowgen_profile * p;
+
+	if ((p = calloc (1, sizeof (*p))) == NULL) {
+		perror ("calloc");
+		return NULL;
+	}
+
+	if (strncmp (spec, "file:", 5) == 0) {
+		p->shape = PROFILE_FILE;
+		if (profile_load_file (p, spec + 5) < 0)
+			goto err;
+		return p;
+	}
+
+	if ((fl = strstr (spec, ",flows=")) != NULL) {
+		if (sscanf (fl, ",flows=%d-%d", &p->flow_lo,
+			    &p->flow_hi) != 2 ||
+		    p->flow_lo < 1 || p->flow_hi < 1)
+			goto err;
+	}
+
+	if (strncmp (spec, "ramp:", 5) == 0) {
+		p->shape = PROFILE_RAMP;
+		ret = sscanf (spec, "ramp:%lf-%lf:%lf",
+			      &p->lo, &p->hi, &p->t1) == 3;
+	} else if (strncmp (spec, "step:", 5) == 0) {
+		p->shape = PROFILE_STEP;
+		ret = sscanf (spec, "step:%lf-%lf:%lf:%d",
+			      &p->lo, &p->hi, &p->t1, &p->steps) == 4 &&
+			p->steps > 1;
+	} else if (strncmp (spec, "sine:", 5) == 0) {
+		p->shape = PROFILE_SINE;
+		ret = sscanf (spec, "sine:%lf-%lf:%lf",
+			      &p->lo, &p->hi, &p->t1) == 3;
+	} else if (strncmp (spec, "onoff:", 6) == 0) {
+		p->shape = PROFILE_ONOFF;
+		ret = sscanf (spec, "onoff:%lf-%lf:%lf:%lf",
+			      &p->lo, &p->hi, &p->t1, &p->t2) == 4;
+	}
+
+	if (!ret || p->lo < 0 || p->hi < 0 || p->t1 <= 0 || p->t2 < 0)
+		goto err;
+
+	return p;
+
+err:
+	D ("invalid load profile %s", spec);
+	free (p);
+	return NULL;
+}
+
+/* target rate and flows (0 means unchanged) at t sec */
+static void
+flowgen_profile_at (struct flowgen_profile * p, double t,
+		    double * pps, int * flows)
+{
+	int n;
+	double f = 0;
+
+	switch (p->shape) {
+	case PROFILE_FILE :
+		/* hold a point until the next one */
+		for (n = 0; n + 1 < p->point_num; n++) {
+			if (t < p->points[n + 1].sec)
+				break;
+		}
+		*pps = p->points[n].pps;
+		*flows = p->points[n].flows;
+		return;
+	case PROFILE_RAMP :
+		f = t < p->t1 ? t / p->t1 : 1;
+		break;
+	case PROFILE_STEP :
+		n = t / p->t1;
+		f = n < p->steps ? (double) n / (p->steps - 1) : 1;
+		break;
+	case PROFILE_SINE :
+		f = (1 - cos (2 * M_PI * t / p->t1)) / 2;
+		break;
+	case PROFILE_ONOFF :
+		f = fmod (t, p->t1 + p->t2) < p->t1 ? 1 : 0;
+		break;
+	}
+
+	*pps = p->lo + (p->hi - p->lo) * f;
+	*flows = p->flow_lo ?
+		p->flow_lo + (int) ((p->flow_hi - p->flow_lo) * f + 0.5) : 0;
+}
+
+/* gap between packets at mono time now, PROFILE_IDLE for no xmit */
+static u_int64_t
+flowgen_profile_gap (struct flowgen_profile * p, u_int64_t now)
+{
+	int flows;
+	double pps;
+
+	flowgen_profile_at (p, (now - p->start) / 1e9, &pps, &flows);
+
+	return pps < 1e-3 ? PROFILE_IDLE :
+		pps >= 1e9 ? 1 : (u_int64_t) (1e9 / pps);
+}
+
+/*
+ * Random distributions for burst sizes, gaps and flow lifetimes:
+ * V (fixed), A-B (uniform), exp:MEAN, pareto:ALPHA:MIN.
+ */
+
+static int
+dist_parse (char * str, struct dist * d)
+{
+	memset (d, 0, sizeof (*d));
+
+	if (sscanf (str, "exp:%lf", &d->a) == 1 && d->a > 0)
+		d->type = DIST_EXP;
+	else if (sscanf (str, "pareto:%lf:%lf", &d->a, &d->b) == 2 &&
+		 d->a > 0 && d->b > 0)
+		d->type = DIST_PARETO;
+	else if (sscanf (str, "%lf-%lf", &d->a, &d->b) == 2 &&
+		 0 <= d->a && d->a <= d->b)
+		d->type = DIST_UNIFORM;
+	else if (sscanf (str, "%lf", &d->a) == 1 && d->a >= 0)
+		d->type = DIST_FIXED;
+	else
+		return -1;
+
+	return 0;
+}
+
+static double
+dist_draw (struct dist * d, struct fastrand * r)
+{
+	switch (d->type) {
+	case DIST_UNIFORM :
+		return d->a + (d->b - d->a) * fastrand_double (r);
+	case DIST_EXP :
+		return -d->a * log (1 - fastrand_double (r));
+	case DIST_PARETO :
+		return d->b / pow (1 - fastrand_double (r), 1 / d->a);
+	}
+
+	return d->a;
+}
+
+/* SIZE[,gap=USEC][,flow][,log=FILE], SIZE and USEC are distributions */
+struct flowgen_burst *
+flowgen_burst_parse (char * spec)
+{
+	char * tok, * save;
+	struct flowgen_burst * bu;
+
+	if ((bu = calloc (1, sizeof (*bu))) == NULL) {
+		perror ("calloc");
+		return NULL;
+	}
+
+	for (tok = strtok_r (spec, ",", &save); tok;
+	     tok = strtok_r (NULL, ",", &save)) {
+		if (strncmp (tok, "gap=", 4) == 0) {
+			if (dist_parse (tok + 4, &bu->gap) < 0)
+				goto err;
+		} else if (strcmp (tok, "flow") == 0) {
+			bu->per_flow = 1;
+		} else if (strncmp (tok, "log=", 4) == 0) {
+			if ((bu->log = fopen (tok + 4, "w")) == NULL) {
+				perror ("fopen");
+				goto err;
+			}
+			fprintf (bu->log, "# start(ns) packets duration(ns) "
+				 "gap(ns)\n");
+		} else if (dist_parse (tok, &bu->size) < 0)
+			goto err;
+	}
+
+	/* sizes are rounded, a burst needs a chance to be 1 or more */
+	if ((bu->size.type == DIST_FIXED && bu->size.a < 1) ||
+	    (bu->size.type == DIST_UNIFORM && bu->size.b < 0.5)) {
+		D ("burst size rounds to 0 packets");
+		goto out;
+	}
+
+	return bu;
+
+err:
+	D ("invalid burst %s", tok);
+out:
+	free (bu);
+	return NULL;
+}
+
+/* close the current burst, idle for a gap and start the next one.
+ * returns 1 when the config c is replaced during the gap. */
+static int
+flowgen_burst_next (struct flowgen_conf * c, struct tx_state * st)
+{
+	int n;
+	u_int64_t now, gap;
+	struct flowgen_burst * bu = c->burst;
+
+	now = nsec_mono ();
+	gap = dist_draw (&bu->gap, &st->rnd) * 1000;
+
+	if (st->burst_start) {
+		bu->bursts++;
+		bu->packets += st->burst_len;
+		bu->nsec += now - st->burst_start;
+		if (now - st->burst_start > bu->nsec_max)
+			bu->nsec_max = now - st->burst_start;
+		if (bu->log)
+			fprintf (bu->log, "%lu %lu %lu %lu\n",
+				 st->burst_start, st->burst_len,
+				 now - st->burst_start, gap);
+		st->burst_start = 0;
+		if (pace_conf (c, now + gap))
+			return 1;
+	}
+
+	for (n = 0; n < BURST_REDRAW; n++) {
+		st->burst_len = dist_draw (&bu->size, &st->rnd) + 0.5;
+		if (st->burst_len)
+			break;
+	}
+	if (!st->burst_len)
+		st->burst_len = 1;
+	st->burst_left = st->burst_len;
+	st->burst_start = nsec_mono ();
+
+	return 0;
+}
+
+void
+flowgen_burst_print (struct flowgen_burst * bu)
+{
+	if (bu->log)
+		fflush (bu->log);
+	if (!bu->bursts)
+		return;
+
+	D ("%lu bursts, avg %.1f packets in %lu nsec (max %lu nsec), "
+	   "%.0f pps in bursts", bu->bursts,
+	   (double) bu->packets / bu->bursts, bu->nsec / bu->bursts,
+	   bu->nsec_max, bu->nsec ? bu->packets * 1e9 / bu->nsec : 0);
+}
+
+/*
+ * Launch time (-j). Packets are queued up to a lead time before they
+ * depart, each with its departure time in a SCM_TXTIME cmsg, and the
+ * ETF qdisc (or fq, or the NIC) releases them at that time.
+ */
+
+/* USEC[,fq][,deadline] */
+static int
+flowgen_txtime_parse (char * spec)
+{
+	char * tok, * save;
+	double usec;
+
+	flowgen.txtime_clock = CLOCK_TAI;
+
+	tok = strtok_r (spec, ",", &save);
+	if (!tok || sscanf (tok, "%lf", &usec) != 1 || usec <= 0) {
+		D ("invalid launch time lead %s", spec);
+		return -1;
+	}
+	flowgen.txtime = usec * 1000;
+
+	while ((tok = strtok_r (NULL, ",", &save)) != NULL) {
+		if (strcmp (tok, "fq") == 0)
+			flowgen.txtime_clock = CLOCK_MONOTONIC;
+		else if (strcmp (tok, "deadline") == 0)
+			flowgen.txtime_flags |= SOF_TXTIME_DEADLINE_MODE;
+		else {
+			D ("invalid launch time option %s", tok);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+flowgen_txtime_init (void)
+{
+	struct timespec mono, clk, real;
+	struct sock_txtime st = {
+		.clockid	= flowgen.txtime_clock,
+		.flags		= flowgen.txtime_flags |
+				  SOF_TXTIME_REPORT_ERRORS,
+	};
+
+	if (setsockopt (flowgen.socket, SOL_SOCKET, SO_TXTIME,
+			&st, sizeof (st)) < 0) {
+		D ("failed to set SO_TXTIME");
+		perror ("setsockopt");
+		exit (1);
+	}
+
+	/* the pacer runs on CLOCK_MONOTONIC */
+	clock_gettime (CLOCK_MONOTONIC, &mono);
+	clock_gettime (flowgen.txtime_clock, &clk);
+	clock_gettime (CLOCK_REALTIME, &real);
+	flowgen.txtime_off = (clk.tv_sec - mono.tv_sec) * 1000000000LL +
+		(clk.tv_nsec - mono.tv_nsec);
+	flowgen.txtime_stamp_off = (real.tv_sec - mono.tv_sec) *
+		1000000000LL + (real.tv_nsec - mono.tv_nsec);
+
+	if (IS_V())
+		D ("launch time %lu nsec ahead on %s", flowgen.txtime,
+		   flowgen.txtime_clock == CLOCK_TAI ? "CLOCK_TAI" :
+		   "CLOCK_MONOTONIC");
+}
+
+static void
+flowgen_txtime_prepare (struct tx_batch * b)
+{
+	int n;
+	u_int64_t t;
+	struct msghdr * m;
+	struct cmsghdr * cm;
+
+	for (n = 0; n < b->num; n++) {
+		m = &b->msgs[n].msg_hdr;
+		m->msg_control = b->cmsgs[n];
+		m->msg_controllen = sizeof (b->cmsgs[n]);
+		cm = CMSG_FIRSTHDR (m);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_TXTIME;
+		cm->cmsg_len = CMSG_LEN (sizeof (t));
+		t = b->slot[n].txtime + flowgen.txtime_off;
+		memcpy (CMSG_DATA (cm), &t, sizeof (t));
+	}
+}
+
+/* count packets the qdisc dropped for their launch time */
+static void
+flowgen_txtime_reap (void)
+{
+	char control[256];
+	struct msghdr m;
+	struct cmsghdr * cm;
+	struct sock_extended_err * ee;
+
+	while (1) {
+		memset (&m, 0, sizeof (m));
+		m.msg_control = control;
+		m.msg_controllen = sizeof (control);
+		if (recvmsg (flowgen.socket, &m,
+			     MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for (cm = CMSG_FIRSTHDR (&m); cm; cm = CMSG_NXTHDR (&m, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *) CMSG_DATA (cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_TXTIME)
+				continue;
+			if (ee->ee_code == SO_EE_CODE_TXTIME_MISSED)
+				flowgen.tx_missed++;
+			else
+				flowgen.tx_invalid++;
+		}
+	}
+}
+
+/* runs until -c packets are sent or the config is replaced */
+static inline __attribute__ ((always_inline)) void
+flowgen_tx_loop (struct flowgen_backend * be, struct tx_state * st,
+		 struct flowgen_conf * c, const int flags)
+{
+	int i, num, ret, batch;
+	unsigned long bytes;
+	u_int32_t extra = 0;
+	u_int64_t now = 0;
+	char * pkt;
+	struct tx_slot * s;
+	struct tx_batch * b = st->b;
+
+	batch = TX_BATCH;
+	if (st->n >= c->flow_list_len)
+		st->n = st->index % c->flow_list_len;
+	if (flags & TX_PACED) {
+		/* xmit threads split the rate */
+		st->gap = c->gap * st->stride;
+		st->last = nsec_mono () - st->gap;
+		st->tick = c->profile ? st->last : PROFILE_IDLE;
+	}
+
+	PROF_START ("xmit", st->index);
+	while (c == __atomic_load_n (&flowgen.conf, __ATOMIC_RELAXED)) {
+		if (flags & TX_PACED) {
+			/* the next packet is due at last + gap. the profile
+			 * updates gap every tick until it is due. */
+			while (st->tick <= st->last ||
+			       st->gap > st->tick - st->last) {
+				if (pace_conf (c, st->tick))
+					return;
+				st->gap = flowgen_profile_gap (c->profile,
+							       st->tick) *
+					st->stride;
+				st->tick += PROFILE_TICK;
+				flowgen.tx_gap = st->gap / st->stride;
+			}
+
+			/* keep the average rate, but do not burst to catch
+			 * up with a long stall. packets already due go out
+			 * in one batch. */
+			st->last += st->gap;
+			now = nsec_mono ();
+			batch = 1;
+			if (flags & TX_TXTIME) {
+				/* queue packets departing within the lead,
+				 * the kernel holds them until their time */
+				if (st->last < now)
+					st->last = now + flowgen.txtime;
+				else if (st->last > now + flowgen.txtime) {
+					if (pace_conf (c, st->last -
+						       flowgen.txtime))
+						return;
+					now = st->last - flowgen.txtime;
+				}
+				if (st->gap) {
+					batch += (now + flowgen.txtime -
+						  st->last) / st->gap;
+					if (batch > TX_BATCH)
+						batch = TX_BATCH;
+				}
+				st->first = st->last;
+				st->last += (batch - 1) * st->gap;
+			} else if (st->last > now) {
+				if (pace_conf (c, st->last))
+					return;
+			}
+			else if (now - st->last > st->gap * TX_BATCH)
+				st->last = now;
+			else if (st->gap) {
+				batch += (now - st->last) / st->gap;
+				if (batch > TX_BATCH)
+					batch = TX_BATCH;
+				st->last += (batch - 1) * st->gap;
+			}
+		}
+
+		num = batch;
+		if (flags & TX_BURST) {
+			if (st->burst_left == 0 && flowgen_burst_next (c, st))
+				return;
+			if (st->burst_left < num)
+				num = st->burst_left;
+		}
+		if ((flags & TX_COUNTED) && st->remain < num)
+			num = st->remain;
+
+		PROF_MARK (PROF_PACE, num);
+
+		/* packets in a batch share a timestamp, except with
+		 * launch time each is stamped with its departure */
+		if ((flags & TX_STAMPED) && !(flags & TX_TXTIME))
+			now = nsec_now ();
+
+		for (i = 0; i < num; i++) {
+			s = &b->slot[i];
+			s->f = &flowgen.flows[c->flow_list[st->n]];
+			s->t = size_picker_next (&st->sp);
+			if (flags & TX_TXTIME) {
+				s->txtime = st->first + i * st->gap;
+				now = s->txtime + flowgen.txtime_stamp_off;
+			}
+			if (!be->frame) {
+				pkt = s->buf;
+				memcpy (pkt, s->t->pkt, s->t->len);
+			} else if ((pkt = be->frame (b, i)) == NULL) {
+				num = i;	/* the rest goes next time */
+				break;
+			}
+			PROF_MARK (PROF_BUILD, 1);
+			if (flags & TX_STAMPED)
+				extra = flowgen_tmpl_stamp (s->t, s->f, pkt,
+							    now);
+			flowgen_tmpl_patch (s->t, s->f, pkt, extra);
+			PROF_MARK (PROF_PATCH, 1);
+
+			/* a per flow burst moves on when it ends */
+			if ((flags & TX_BURST) && c->burst->per_flow &&
+			    st->burst_left - i > 1)
+				continue;
+			st->n += st->stride;
+			if (st->n >= c->flow_list_len)
+				st->n %= c->flow_list_len;
+		}
+
+		b->num = num;
+		be->prepare (b);
+		if (flags & TX_TXTIME)
+			flowgen_txtime_prepare (b);
+		ret = be->submit (b);
+		if (be->reap)
+			be->reap (b);
+		if (flags & TX_TXTIME)
+			flowgen_txtime_reap ();
+		PROF_MARK (PROF_SEND, num);
+
+		if (ret < 0) {
+			perror ("send");
+			ret = 0;
+		}
+
+		/* packets not sent give back their sequence numbers, so
+		 * the receiver does not count them as lost. the tail is
+		 * stamped last, so the numbers of each flow stay dense. */
+		if (flags & TX_STAMPED) {
+			for (i = num - 1; i >= ret; i--) {
+				if (b->slot[i].t->hdr_off)
+					b->slot[i].f->seq--;
+			}
+		}
+
+		for (i = 0, bytes = 0; i < ret; i++) {
+			bytes += b->slot[i].t->len;
+
+			if (flags & TX_VERBOSE)
+				D ("[%lu] %d: send %d bytes port %d",
+				   time (NULL), ++cnt, b->slot[i].t->len,
+				   b->slot[i].f->sport);
+		}
+		__atomic_fetch_add (&flowgen.tx_packets, ret,
+				    __ATOMIC_RELAXED);
+		__atomic_fetch_add (&flowgen.tx_bytes, bytes,
+				    __ATOMIC_RELAXED);
+		__atomic_fetch_add (&flowgen.tx_errors, num - ret,
+				    __ATOMIC_RELAXED);
+		PROF_MARK (PROF_ACCT, num);
+
+		if (flags & TX_BURST)
+			st->burst_left -= num;
+
+		if (flags & TX_COUNTED) {
+			st->remain -= num;
+			if (st->remain == 0) {
+				st->done = 1;
+				return;
+			}
+		}
+	}
+}
+
+/* calls X (b5, b4, b3, b2, b1, b0) for every combination of the six
+ * flag bits, in order of the flags value */
+#define TX_BITS0(X, a, b, c, d, e)	X (a, b, c, d, e, 0)		\
+					X (a, b, c, d, e, 1)
+#define TX_BITS1(X, a, b, c, d)		TX_BITS0 (X, a, b, c, d, 0)	\
+					TX_BITS0 (X, a, b, c, d, 1)
+#define TX_BITS2(X, a, b, c)		TX_BITS1 (X, a, b, c, 0)	\
+					TX_BITS1 (X, a, b, c, 1)
+#define TX_BITS3(X, a, b)		TX_BITS2 (X, a, b, 0)		\
+					TX_BITS2 (X, a, b, 1)
+#define TX_BITS4(X, a)			TX_BITS3 (X, a, 0) TX_BITS3 (X, a, 1)
+#define TX_LOOPS(X)			TX_BITS4 (X, 0) TX_BITS4 (X, 1)
+
+#define TX_FLAGS(b5, b4, b3, b2, b1, b0)				\
+	((b5 ? TX_TXTIME : 0) | (b4 ? TX_BURST : 0) |			\
+	 (b3 ? TX_STAMPED : 0) | (b2 ? TX_VERBOSE : 0) |		\
+	 (b1 ? TX_PACED : 0) | (b0 ? TX_COUNTED : 0))
+
+#define TX_LOOP(b5, b4, b3, b2, b1, b0)					\
+	static void							\
+	flowgen_tx_loop_##b5##b4##b3##b2##b1##b0 (struct flowgen_backend * be, \
+						  struct tx_state * st,	\
+						  struct flowgen_conf * c) \
+	{ flowgen_tx_loop (be, st, c, TX_FLAGS (b5, b4, b3, b2, b1, b0)); }
+
+#define TX_LOOP_ENTRY(b5, b4, b3, b2, b1, b0)				\
+	[TX_FLAGS (b5, b4, b3, b2, b1, b0)] =				\
+		flowgen_tx_loop_##b5##b4##b3##b2##b1##b0,
+
+TX_LOOPS (TX_LOOP)
+
+static void (* flowgen_tx_loops[TX_LOOP_NUM]) (struct flowgen_backend *,
+					       struct tx_state *,
+					       struct flowgen_conf *) = {
+	TX_LOOPS (TX_LOOP_ENTRY)
+};
+
+/* take the current config. once conf_seen points it, the config is
+ * not freed until the xmit loop moves to another one. */
+static struct flowgen_conf *
+flowgen_conf_acquire (int index)
+{
+	struct flowgen_conf * c;
+
+	do {
+		c = __atomic_load_n (&flowgen.conf, __ATOMIC_SEQ_CST);
+		__atomic_store_n (&flowgen.conf_seen[index], c,
+				  __ATOMIC_SEQ_CST);
+	} while (c != __atomic_load_n (&flowgen.conf, __ATOMIC_SEQ_CST));
+
+	return c;
+}
+
+/* an xmit thread. with several, each takes every stride-th entry of
+ * the flow list at 1/stride of the rate, and sends on its own queue. */
+static void *
+flowgen_xmit_thread (void * param)
+{
+	int flags;
+	struct tx_state * st = param;
+	struct flowgen_conf * c;
+	struct flowgen_backend * be = &flowgen_backends[flowgen.backend];
+
+#ifdef FLOWGEN_DPDK
+	/* an lcore id for the mempool cache */
+	if (IS_DPDK() && st->index)
+		rte_thread_register ();
+#endif
+
+	/* the pacer sleeps to deadlines, default 50us slack is too long */
+	prctl (PR_SET_TIMERSLACK, 1);
+
+	while (!st->done) {
+		c = flowgen_conf_acquire (st->index);
+		if (c->paused || !c->flow_list_len) {
+			pace_conf (c, nsec_mono () + 100000000ULL);
+			continue;
+		}
+
+		flags = 0;
+		if (flowgen.count)
+			flags |= TX_COUNTED;
+		if (c->burst)
+			flags |= TX_BURST;
+		else if (c->gap || c->profile)
+			flags |= TX_PACED;
+		if (IS_V())
+			flags |= TX_VERBOSE;
+		if (flowgen.tstamp)
+			flags |= TX_STAMPED;
+		if (flowgen.txtime && (flags & TX_PACED))
+			flags |= TX_TXTIME;
+
+		if (IS_V())
+			D ("xmit %d with %s backend, loop %d", st->index,
+			   be->name, flags);
+
+		flowgen_tx_loops[flags] (be, st, c);
+	}
+
+	/* no config is in use until the next start */
+	__atomic_store_n (&flowgen.conf_seen[st->index], NULL,
+			  __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+void
+flowgen_start (void)
+{
+	int n, num = flowgen.xmit_threads;
+	pthread_t tids[XMIT_MAX];
+	struct tx_state st[XMIT_MAX];
+	struct flowgen_backend * be = &flowgen_backends[flowgen.backend];
+
+	if (flowgen.count)
+		D ("xmit %lu packets", flowgen.count);
+
+	memset (st, 0, sizeof (st[0]) * num);
+	for (n = 0; n < num; n++) {
+		st[n].index = n;
+		st[n].stride = num;
+		st[n].n = n;
+		size_picker_init (&st[n].sp, n ? 32 + n * 2 : 1);
+		fastrand_init (&st[n].rnd, flowgen.seed, n ? 33 + n * 2 : 2);
+
+		/* -c packets are split over threads */
+		st[n].remain = flowgen.count / num +
+			(n < flowgen.count % num);
+		st[n].done = flowgen.count && !st[n].remain;
+
+		/* kept for later runs of the search */
+		if (!flowgen.batch[n])
+			flowgen.batch[n] =
+				flowgen_pool_alloc (sizeof (*st[n].b));
+		st[n].b = flowgen.batch[n];
+#ifdef FLOWGEN_DPDK
+		st[n].b->queue = n;
+#endif
+	}
+
+	/* thread 0 is this one, the others follow the receive threads */
+	flowgen_pin (pthread_self (), 0);
+	for (n = 1; n < num; n++) {
+		pthread_create (&tids[n], NULL, flowgen_xmit_thread, &st[n]);
+		flowgen_pin (tids[n], flowgen.rx_threads + n);
+	}
+	flowgen_xmit_thread (&st[0]);
+	for (n = 1; n < num; n++)
+		pthread_join (tids[n], NULL);
+
+	D ("xmit %lu packets %lu bytes, %lu errors", flowgen.tx_packets,
+	   flowgen.tx_bytes, flowgen.tx_errors);
+	if (flowgen.txtime) {
+		flowgen_txtime_reap ();
+		D ("launch time missed %lu, invalid %lu", flowgen.tx_missed,
+		   flowgen.tx_invalid);
+	}
+	if (be->stats)
+		be->stats ();
+	if (flowgen.conf->burst)
+		flowgen_burst_print (flowgen.conf->burst);
+}
+
+/* initial runtime config from the command line options */
+void
+flowgen_conf_init (void)
+{
+	struct flowgen_conf * c;
+
+	if ((c = calloc (1, sizeof (*c))) == NULL) {
+		D ("failed to allocate config");
+		perror ("calloc");
+		exit (1);
+	}
+
+	c->flow_dist = flowgen.flow_dist;
+	c->flow_num = flowgen.flow_num;
+	c->gap = flowgen.interval * 1000ULL;
+	c->profile = flowgen.profile;
+	c->burst = flowgen.burst;
+	if (c->profile)
+		c->profile->start = nsec_mono ();
+	flowgen_flow_dist_init[c->flow_dist] (c);
+
+	flowgen.conf = c;
+}
+
+/* publish a new config and wake xmit sleeping on the old one. the old
+ * one is retired, and freed by a later swap once no xmit thread sees
+ * it (RCU style), so writers never wait for xmit. called with
+ * conf_lock held. */
+static void
+flowgen_conf_swap (struct flowgen_conf * c)
+{
+	int n;
+	struct flowgen_conf * old = flowgen.conf, ** r, * d;
+
+	__atomic_store_n (&flowgen.conf, c, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add (&flowgen.conf_gen, 1, __ATOMIC_SEQ_CST);
+	syscall (SYS_futex, &flowgen.conf_gen, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+		 INT_MAX, NULL, NULL, 0);
+
+	old->retired = flowgen.conf_retired;
+	flowgen.conf_retired = old;
+
+	for (r = &flowgen.conf_retired; *r; ) {
+		for (n = 0; n < flowgen.xmit_threads; n++) {
+			if (__atomic_load_n (&flowgen.conf_seen[n],
+					     __ATOMIC_SEQ_CST) == *r)
+				break;
+		}
+		if (n < flowgen.xmit_threads) {
+			r = &(*r)->retired;
+			continue;
+		}
+		d = *r;
+		*r = d->retired;
+		free (d);
+	}
+}
+
+static int
+flow_dist_parse (char * str)
+{
+	int n;
+
+	for (n = 0; n < 3; n++) {
+		if (strncmp (str, flowgen_flow_dist_name[n],
+			     strlen (flowgen_flow_dist_name[n])) == 0)
+			return n;
+	}
+
+	return -1;
+}
+
+static int
+flowgen_ctl_apply (char * cmd, char * out, int outlen)
+{
+	int ret, num, base, label = flowgen.label_num > 1 ?
+		flowgen.label_num : 1;
+	char arg[64];
+	double val;
+	struct flowgen_profile * p;
+	struct flowgen_conf * c, * cur = flowgen.conf;
+
+	arg[0] = '\0';
+	if (strncmp (cmd, "stats", 5) == 0) {
+		return snprintf (out, outlen,
+				 "tx %lu packets %lu bytes %lu errors "
+				 "%lu missed\n"
+				 "flows %d dist %s gap %lu nsec%s%s\n",
+				 flowgen.tx_packets, flowgen.tx_bytes,
+				 flowgen.tx_errors, flowgen.tx_missed,
+				 cur->flow_num / label,
+				 flowgen_flow_dist_name[cur->flow_dist],
+				 cur->profile ? flowgen.tx_gap : cur->gap,
+				 cur->profile ? " profile" : "",
+				 cur->paused ? " paused" : "");
+	}
+
+	if ((c = malloc (sizeof (*c))) == NULL)
+		return snprintf (out, outlen, "error: no memory\n");
+	memcpy (c, cur, sizeof (*c));
+
+	if (strncmp (cmd, "pause", 5) == 0)
+		c->paused = 1;
+	else if (strncmp (cmd, "resume", 6) == 0)
+		c->paused = 0;
+	else if (sscanf (cmd, "rate %lf", &val) == 1 && val >= 0) {
+		c->gap = val > 0 ? 1000000000ULL / val : 0;
+		c->profile = NULL;
+	} else if (sscanf (cmd, "interval %lf", &val) == 1 && val >= 0) {
+		c->gap = val * 1000;
+		c->profile = NULL;
+	} else if (sscanf (cmd, "profile %63s", arg) == 1) {
+		if ((p = flowgen_profile_parse (arg)) == NULL) {
+			free (c);
+			return snprintf (out, outlen,
+					 "error: invalid profile %s\n", arg);
+		}
+		p->start = nsec_mono ();
+		c->profile = p;
+	} else if (sscanf (cmd, "dist %63s", arg) == 1 &&
+		 (ret = flow_dist_parse (arg)) >= 0) {
+		c->flow_dist = ret;
+		if (flowgen.life)
+			__atomic_store_n (&flowgen.life->republish, 1,
+					  __ATOMIC_RELAXED);
+		else
+			flowgen_flow_dist_init[c->flow_dist] (c);
+	} else if (flowgen.life && strncmp (cmd, "flows", 5) == 0) {
+		free (c);
+		return snprintf (out, outlen,
+				 "error: flows are managed by -O\n");
+	} else if (sscanf (cmd, "flows %63s", arg) == 1) {
+		/* flows N, +N or -N source ports */
+		base = cur->flow_num / label;
+		num = atoi (arg);
+		if (arg[0] == '+' || arg[0] == '-')
+			num += base;
+		if (num < 1 || num * label > flowgen.flow_cap) {
+			free (c);
+			return snprintf (out, outlen,
+					 "error: flows must be 1 to %d\n",
+					 flowgen.flow_cap / label);
+		}
+		c->flow_num = num * label;
+		flowgen_flow_dist_init[c->flow_dist] (c);
+	} else {
+		free (c);
+		return snprintf (out, outlen,
+				 "error: commands are rate PPS, interval USEC, "
+				 "profile SPEC, dist {same|random|power}, "
+				 "flows [+|-]N, pause, resume and stats\n");
+	}
+
+	flowgen_conf_swap (c);
+
+	return snprintf (out, outlen, "ok\n");
+}
+
+/* execute a command line. returns reply length written to out */
+static int
+flowgen_ctl_exec (char * cmd, char * out, int outlen)
+{
+	int ret;
+
+	pthread_mutex_lock (&flowgen.conf_lock);
+	ret = flowgen_ctl_apply (cmd, out, outlen);
+	pthread_mutex_unlock (&flowgen.conf_lock);
+
+	return ret;
+}
+
+/* flows of a load profile change the flow list, so they are applied
+ * by swapping the config here. rate is applied by the pacer. */
+void *
+flowgen_profile_thread (void * param)
+{
+	int flows, label = flowgen.label_num > 1 ? flowgen.label_num : 1;
+	double pps;
+	struct flowgen_conf * c, * cur;
+	struct flowgen_profile * p;
+
+	while (1) {
+		usleep (10000);	/* flows change at 10ms granularity */
+
+		pthread_mutex_lock (&flowgen.conf_lock);
+		cur = flowgen.conf;
+		if ((p = cur->profile) == NULL)
+			goto next;
+
+		flowgen_profile_at (p, (nsec_mono () - p->start) / 1e9,
+				    &pps, &flows);
+		if (flows < 1 || flowgen.life)
+			goto next;	/* -O owns the flows */
+		if (flows * label > flowgen.flow_cap)
+			flows = flowgen.flow_cap / label;
+		if (flows * label == cur->flow_num)
+			goto next;
+
+		if ((c = malloc (sizeof (*c))) == NULL)
+			goto next;
+		memcpy (c, cur, sizeof (*c));
+		c->flow_num = flows * label;
+		flowgen_flow_dist_init[c->flow_dist] (c);
+		flowgen_conf_swap (c);
+	next:
+		pthread_mutex_unlock (&flowgen.conf_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Flow lifecycle (-O). Flows are born with new source ports and die
+ * after their on time. Slots of flows[] are reused only after the
+ * config swap that removed them, so the xmit loop never sees a flow
+ * changing under it. The aggregate rate does not depend on the
+ * number of live flows.
+ */
+
+static double
+dist_mean (struct dist * d)
+{
+	switch (d->type) {
+	case DIST_UNIFORM :
+		return (d->a + d->b) / 2;
+	case DIST_PARETO :
+		return d->a > 1 ? d->a * d->b / (d->a - 1) : d->b * 10;
+	}
+
+	return d->a;	/* fixed and exp */
+}
+
+/* arrival=RATE,on=SEC or on=SEC[,off=SEC], SEC are distributions */
+struct flowgen_life *
+flowgen_life_parse (char * spec)
+{
+	char * tok, * save;
+	struct flowgen_life * l;
+
+	if ((l = calloc (1, sizeof (*l))) == NULL) {
+		perror ("calloc");
+		return NULL;
+	}
+
+	for (tok = strtok_r (spec, ",", &save); tok;
+	     tok = strtok_r (NULL, ",", &save)) {
+		if (sscanf (tok, "arrival=%lf", &l->arrival) == 1 &&
+		    l->arrival > 0)
+			continue;
+		if (strncmp (tok, "on=", 3) == 0 &&
+		    dist_parse (tok + 3, &l->on) == 0)
+			continue;
+		if (strncmp (tok, "off=", 4) == 0 &&
+		    dist_parse (tok + 4, &l->off) == 0)
+			continue;
+		D ("invalid flow lifecycle %s", tok);
+		free (l);
+		return NULL;
+	}
+
+	if (dist_mean (&l->on) <= 0) {
+		D ("flow lifecycle needs on time");
+		free (l);
+		return NULL;
+	}
+
+	return l;
+}
+
+/* give slot n a new 5-tuple and the time it dies */
+static void
+life_birth (struct flowgen_life * l, int n, u_int64_t now, double life)
+{
+	u_int16_t sport;
+	struct flow * f = &flowgen.flows[n];
+
+	do {
+		sport = SRCPORT_START +
+			fastrand_range (&l->rnd, SRCPORT_MAX - SRCPORT_START);
+	} while (l->used[sport]);
+
+	l->used[f->sport] = 0;
+	l->used[sport] = 1;
+	f->sport = sport;
+	f->entropy = flow_entropy (sport, f->label);
+	f->seq = 0;
+
+	l->slot[n].live = 1;
+	l->slot[n].until = now + life * 1e9;
+	l->births++;
+}
+
+static void
+life_death (struct flowgen_life * l, int n, u_int64_t now, int tick)
+{
+	l->slot[n].live = 0;
+	l->slot[n].dead_tick = tick;
+	l->slot[n].until = l->arrival ? 0 :
+		now + dist_draw (&l->off, &l->rnd) * 1e9;
+	l->deaths++;
+}
+
+/* build the flow list of live flows */
+static void
+life_flow_list (struct flowgen_life * l, struct flowgen_conf * c)
+{
+	int n, live[FLOW_MAX], num = 0;
+
+	for (n = 0; n < flowgen.flow_cap; n++) {
+		if (l->slot[n].live)
+			live[num++] = n;
+	}
+
+	c->flow_num = num;
+	c->flow_list_len = 0;
+	if (num) {
+		flowgen_flow_dist_init[c->flow_dist] (c);
+		for (n = 0; n < c->flow_list_len; n++)
+			c->flow_list[n] = live[c->flow_list[n]];
+	}
+
+	l->live = num;
+}
+
+static void
+life_publish (struct flowgen_life * l)
+{
+	struct flowgen_conf * c;
+
+	pthread_mutex_lock (&flowgen.conf_lock);
+	if ((c = malloc (sizeof (*c))) != NULL) {
+		memcpy (c, flowgen.conf, sizeof (*c));
+		life_flow_list (l, c);
+		flowgen_conf_swap (c);
+	}
+	pthread_mutex_unlock (&flowgen.conf_lock);
+}
+
+void *
+flowgen_life_thread (void * param)
+{
+	int n, tick = 0, changed;
+	unsigned long births = 0, deaths = 0;
+	time_t sec, last = time (NULL);
+	u_int64_t now;
+	struct flowgen_life * l = flowgen.life;
+
+	while (1) {
+		usleep (LIFE_TICK);
+		now = nsec_mono ();
+		tick++;
+		changed = 0;
+
+		for (n = 0; n < flowgen.flow_cap; n++) {
+			if (l->slot[n].live && l->slot[n].until <= now) {
+				life_death (l, n, now, tick);
+				changed = 1;
+			}
+			/* on/off flows come back with a new tuple */
+			if (!l->arrival && n < l->slots &&
+			    !l->slot[n].live && l->slot[n].until <= now &&
+			    l->slot[n].dead_tick < tick) {
+				life_birth (l, n, now,
+					    dist_draw (&l->on, &l->rnd));
+				changed = 1;
+			}
+		}
+
+		/* poisson arrivals into slots freed by former ticks */
+		while (l->arrival && l->next_arrival <= now) {
+			l->next_arrival += -log (1 - fastrand_double (&l->rnd))
+				/ l->arrival * 1e9;
+			for (n = 0; n < flowgen.flow_cap; n++) {
+				if (!l->slot[n].live &&
+				    l->slot[n].dead_tick < tick)
+					break;
+			}
+			if (n == flowgen.flow_cap) {
+				l->blocked++;
+				continue;
+			}
+			life_birth (l, n, now, dist_draw (&l->on, &l->rnd));
+			changed = 1;
+		}
+
+		if (__atomic_exchange_n (&l->republish, 0, __ATOMIC_RELAXED) ||
+		    changed)
+			life_publish (l);
+
+		sec = time (NULL);
+		if (sec != last) {
+			D ("[%lu] %d live flows, %lu births %lu deaths, "
+			   "%lu blocked", sec, l->live, l->births - births,
+			   l->deaths - deaths, l->blocked);
+			births = l->births;
+			deaths = l->deaths;
+			last = sec;
+		}
+	}
+
+	return NULL;
+}
+
+/* initial live flows, in the steady state of the lifecycle */
+void
+flowgen_life_init (void)
+{
+	int n, num;
+	double on, off;
+	u_int64_t now = nsec_mono ();
+	struct flowgen_life * l = flowgen.life;
+
+	fastrand_init (&l->rnd, flowgen.seed, 3);
+
+	for (n = 0; n < flowgen.flow_cap; n++)
+		l->used[flowgen.flows[n].sport] = 1;
+
+	if (l->arrival) {
+		/* little's law, concurrent flows = arrival * on time */
+		num = l->arrival * dist_mean (&l->on) + 0.5;
+		if (num > flowgen.flow_cap)
+			num = flowgen.flow_cap;
+		l->next_arrival = now;
+	} else {
+		num = l->slots = flowgen.flow_num;
+	}
+
+	on = dist_mean (&l->on);
+	off = dist_mean (&l->off);
+
+	for (n = 0; n < num; n++) {
+		/* residual life, and on/off slots start off by ratio */
+		if (!l->arrival &&
+		    fastrand_double (&l->rnd) < off / (on + off)) {
+			l->slot[n].until = now +
+				fastrand_double (&l->rnd) * off * 1e9;
+			continue;
+		}
+		l->slot[n].live = 1;
+		l->slot[n].until = now +
+			fastrand_double (&l->rnd) * dist_draw (&l->on,
+							       &l->rnd) * 1e9;
+	}
+
+	/* xmit is not running yet */
+	life_flow_list (l, flowgen.conf);
+
+	D ("flow lifecycle starts with %d live flows", l->live);
+}
+
+void
+flowgen_ctl_init (void)
+{
+	int sock;
+	struct stat st;
+	struct sockaddr_un sun;
+
+	if (strlen (flowgen.ctl_path) >= sizeof (sun.sun_path)) {
+		D ("control socket path %s is too long", flowgen.ctl_path);
+		exit (1);
+	}
+
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, flowgen.ctl_path);
+
+	if ((sock = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		D ("failed to create control socket");
+		perror ("socket");
+		exit (1);
+	}
+
+	/* remove a stale socket of a previous run, never anything else */
+	if (lstat (flowgen.ctl_path, &st) == 0) {
+		if (!S_ISSOCK (st.st_mode)) {
+			D ("%s exists and is not a socket", flowgen.ctl_path);
+			exit (1);
+		}
+		unlink (flowgen.ctl_path);
+	}
+	if (bind (sock, (struct sockaddr *) &sun, sizeof (sun)) < 0 ||
+	    listen (sock, 4) < 0) {
+		D ("failed to bind control socket %s", flowgen.ctl_path);
+		perror ("bind");
+		exit (1);
+	}
+
+	flowgen.ctl_sock = sock;
+}
+
+/* one client at a time, one command per line */
+void *
+flowgen_ctl_thread (void * param)
+{
+	int fd, ret, len, pos;
+	char buf[1024], out[1024], * nl;
+
+	while (1) {
+		if ((fd = accept (flowgen.ctl_sock, NULL, NULL)) < 0) {
+			perror ("accept");
+			continue;
+		}
+
+		pos = 0;
+		while ((ret = read (fd, buf + pos,
+				    sizeof (buf) - pos - 1)) > 0) {
+			pos += ret;
+			buf[pos] = '\0';
+
+			while ((nl = strchr (buf, '\n')) != NULL) {
+				*nl = '\0';
+				len = flowgen_ctl_exec (buf, out, sizeof (out));
+				if (write (fd, out, len) < 0)
+					break;
+				if (IS_V())
+					D ("control: %s", buf);
+				pos -= nl + 1 - buf;
+				memmove (buf, nl + 1, pos + 1);
+			}
+
+			if (pos == sizeof (buf) - 1)
+				pos = 0;	/* drop a too long line */
+		}
+
+		close (fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * RFC 2544 style search of the maximum rate without loss (-b). Trials
+ * run the xmit loop for a fixed number of packets at a rate, and the
+ * receive thread (-w) counts what came back.
+ */
+
+static unsigned long
+flowgen_rx_count (void)
+{
+	int n;
+	unsigned long cnt = 0;
+
+	if (!flowgen.rx_ifname && !IS_DPDK())
+		return __atomic_load_n (&flowgen.rx_packets,
+					__ATOMIC_RELAXED);
+
+	for (n = 0; n < flowgen.rx_threads; n++)
+		cnt += __atomic_load_n (&flowgen.rx_rings[n].fg_packets,
+					__ATOMIC_RELAXED);
+	return cnt;
+}
+
+int
+flowgen_search_parse (char * spec)
+{
+	char * tok, * save;
+	struct search * s = &flowgen.search;
+
+	s->trial = SEARCH_TRIAL;
+	s->loss = 0;
+	s->res = SEARCH_RES;
+
+	for (tok = strtok_r (spec, ",", &save); tok;
+	     tok = strtok_r (NULL, ",", &save)) {
+		if (sscanf (tok, "%lf-%lf", &s->lo, &s->hi) == 2)
+			continue;
+		if (sscanf (tok, "trial=%lf", &s->trial) == 1 ||
+		    sscanf (tok, "loss=%lf", &s->loss) == 1 ||
+		    sscanf (tok, "res=%lf", &s->res) == 1)
+			continue;
+		if (strcmp (tok, "dist=all") == 0) {
+			s->all_dist = 1;
+			continue;
+		}
+		D ("invalid search parameter %s", tok);
+		return -1;
+	}
+
+	if (s->lo <= 0 || s->hi < s->lo || s->trial <= 0 ||
+	    s->loss < 0 || s->res <= 0) {
+		D ("search needs LO-HI pps, and positive trial and res");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* swap in a copy of the config with the trial rate and distribution */
+static void
+flowgen_search_conf (double pps, int dist)
+{
+	struct flowgen_conf * c;
+
+	pthread_mutex_lock (&flowgen.conf_lock);
+	if ((c = malloc (sizeof (*c))) == NULL) {
+		D ("failed to allocate config");
+		perror ("malloc");
+		exit (1);
+	}
+	memcpy (c, flowgen.conf, sizeof (*c));
+	if (pps > 0)
+		c->gap = 1e9 / pps;
+	if (c->flow_dist != dist) {
+		c->flow_dist = dist;
+		flowgen_flow_dist_init[dist] (c);
+	}
+	flowgen_conf_swap (c);
+	pthread_mutex_unlock (&flowgen.conf_lock);
+}
+
+/* returns loss in percent of offered packets at pps */
+static double
+flowgen_search_trial (double pps, int size, double * rate)
+{
+	unsigned long offered, sent, rx;
+	u_int64_t start, elapsed;
+	double loss;
+	struct search * s = &flowgen.search;
+
+	offered = pps * s->trial;
+	if (offered == 0)
+		offered = 1;
+
+	flowgen.count = offered;
+	flowgen_search_conf (pps, flowgen.conf->flow_dist);
+
+	rx = flowgen_rx_count ();
+	sent = flowgen.tx_packets;
+	start = nsec_mono ();
+	flowgen_start ();
+	elapsed = nsec_mono () - start;
+	sent = flowgen.tx_packets - sent;
+
+	sleep (SEARCH_DRAIN);
+	rx = flowgen_rx_count () - rx;
+
+	/* send errors count as loss of the offered load */
+	loss = rx < offered ? (offered - rx) * 100.0 / offered : 0;
+	D ("trial %.0f pps size %d: offered %lu sent %lu received %lu, "
+	   "loss %.4f%%", pps, size, offered, sent, rx, loss);
+
+	/* the offered load was not kept up. the loss is still of all the
+	 * packets counted, but the rate passed is what xmit achieved */
+	*rate = pps;
+	if (elapsed > s->trial * 1e9 * 1.01 + PROFILE_TICK) {
+		*rate = sent / (elapsed / 1e9);
+		D ("xmit took %.3f sec, %.0f pps is the limit of this host",
+		   elapsed / 1e9, *rate);
+	}
+
+	return loss;
+}
+
+/* binary search on the current flow list and size list */
+static void
+flowgen_search_one (int size, struct search_result * r)
+{
+	double lo, hi, mid, loss, rate;
+	struct search * s = &flowgen.search;
+
+	lo = s->lo;
+	hi = s->hi;
+	r->pps = 0;
+	r->loss = 100;
+
+	if ((loss = flowgen_search_trial (hi, size, &rate)) <= s->loss) {
+		r->pps = rate;
+		r->loss = loss;
+		return;
+	}
+
+	/* nothing to bisect when even the lower bound loses */
+	if ((loss = flowgen_search_trial (lo, size, &rate)) > s->loss) {
+		r->loss = loss;
+		return;
+	}
+	r->pps = rate;
+	r->loss = loss;
+	if (rate < lo)
+		return;		/* xmit can not go faster */
+
+	while (hi - lo > hi * s->res / 100) {
+		mid = (lo + hi) / 2;
+		loss = flowgen_search_trial (mid, size, &rate);
+		if (loss <= s->loss) {
+			lo = mid;
+			r->pps = rate;
+			r->loss = loss;
+			if (rate < mid)
+				break;	/* xmit can not go faster */
+		} else
+			hi = mid;
+	}
+}
+
+void
+flowgen_search (void)
+{
+	int n, i, d, dmin, dmax, rows = 0, len, sizes;
+	double avg;
+	u_int16_t * size_list;
+	struct search_result * r, res[(SEARCH_SIZE_MAX + 1) * 3];
+
+	if ((size_list = malloc (sizeof (flowgen.size_list))) == NULL) {
+		perror ("malloc");
+		exit (1);
+	}
+	memcpy (size_list, flowgen.size_list, sizeof (flowgen.size_list));
+	len = flowgen.size_list_len;
+
+	/* each size alone, and the mix of them */
+	sizes = flowgen.tmpl_num;
+	if (sizes == 1 || sizes > SEARCH_SIZE_MAX)
+		sizes = 0;
+
+	d = flowgen.conf->flow_dist;
+	dmin = flowgen.search.all_dist ? 0 : d;
+	dmax = flowgen.search.all_dist ? FLOWDIST_DWER : d;
+
+	/* let the receiver start */
+	sleep (SEARCH_DRAIN);
+
+	for (d = dmin; d <= dmax; d++) {
+		flowgen_search_conf (0, d);
+
+		for (n = 0; n <= sizes; n++) {
+			r = &res[rows++];
+			r->dist = d;
+
+			if (n < sizes) {
+				flowgen.size_list[0] = n;
+				flowgen.size_list_len = 1;
+				avg = flowgen.tmpls[n].len;
+			} else {
+				memcpy (flowgen.size_list, size_list,
+					sizeof (flowgen.size_list));
+				flowgen.size_list_len = len;
+				for (avg = 0, i = 0; i < len; i++)
+					avg += flowgen.tmpls[size_list[i]].len;
+				avg /= len;
+			}
+
+			r->size = avg;
+			r->mix = (n == sizes && flowgen.tmpl_num > 1);
+			flowgen_search_one (avg, r);
+		}
+	}
+
+	free (size_list);
+
+	printf ("\n%-6s %-7s %14s %12s %9s\n",
+		"size", "dist", "rate(pps)", "rate(Mbps)", "loss(%)");
+	for (n = 0; n < rows; n++) {
+		r = &res[n];
+		if (r->mix)
+			printf ("%-6s ", "mix");
+		else
+			printf ("%-6.0f ", r->size);
+		printf ("%-7s %14.0f %12.3f %9.4f\n",
+			flowgen_flow_dist_name[r->dist], r->pps,
+			r->pps * r->size * 8 / 1e6, r->loss);
+	}
+	fflush (stdout);
+}
+
+/* one writer per stat, merged by the stats thread while it is written */
+#define RTT_LOAD(x)	__atomic_load_n (&(x), __ATOMIC_RELAXED)
+#define RTT_STORE(x, v)	__atomic_store_n (&(x), (v), __ATOMIC_RELAXED)
+
+static void
+rtt_stat_add (struct rtt_stat * r, u_int64_t ns)
+{
+	int b = ns ? 63 - __builtin_clzll (ns) : 0;
+
+	if (!r->count || ns < r->min)
+		RTT_STORE (r->min, ns);
+	if (ns > r->max)
+		RTT_STORE (r->max, ns);
+	RTT_STORE (r->sum, r->sum + ns);
+	RTT_STORE (r->hist[b], r->hist[b] + 1);
+	RTT_STORE (r->count, r->count + 1);
+}
+
+static void
+rtt_stat_merge (struct rtt_stat * dst, struct rtt_stat * src)
+{
+	int b;
+	u_int64_t min, max;
+
+	if (!RTT_LOAD (src->count))
+		return;
+	min = RTT_LOAD (src->min);
+	max = RTT_LOAD (src->max);
+	if (!dst->count || min < dst->min)
+		dst->min = min;
+	if (max > dst->max)
+		dst->max = max;
+	dst->count += RTT_LOAD (src->count);
+	dst->sum += RTT_LOAD (src->sum);
+	for (b = 0; b < RTT_BUCKETS; b++)
+		dst->hist[b] += RTT_LOAD (src->hist[b]);
+}
+
+/* upper bound of the bucket holding the percentile */
+static u_int64_t
+rtt_stat_percentile (struct rtt_stat * r, float pct)
+{
+	int b;
+	unsigned long n = 0;
+
+	for (b = 0; b < RTT_BUCKETS; b++) {
+		n += r->hist[b];
+		if (n >= r->count * pct / 100)
+			break;
+	}
+
+	return b < 63 ? (2ULL << b) - 1 : ~0ULL;
+}
+
+static void
+rtt_stat_print (struct rtt_stat * r)
+{
+	if (!r->count)
+		return;
+
+	D ("rtt %lu samples, min %lu avg %lu max %lu p50 <%lu p99 <%lu nsec",
+	   r->count, r->min, r->sum / r->count, r->max,
+	   rtt_stat_percentile (r, 50), rtt_stat_percentile (r, 99));
+}
+
+/* round trip time of a reflected flowgen packet */
+static inline void
+flowgen_rtt (struct pkt_info * pi, u_int64_t now, struct rtt_stat * r)
+{
+	struct flowgen_hdr hdr;
+
+	if (pi->len < sizeof (struct udphdr) + sizeof (hdr))
+		return;
+
+	memcpy (&hdr, (char *) pi->udp + sizeof (struct udphdr),
+		sizeof (hdr));
+	if (hdr.magic != htonl (FLOWGEN_MAGIC))
+		return;
+
+	if (now > be64toh (hdr.tstamp))
+		rtt_stat_add (r, now - be64toh (hdr.tstamp));
+}
+
+/* udp socket bound to DSTPORT, dual stack if possible */
+int
+flowgen_udp_bind_socket (void)
+{
+	int sock, off = 0;
+	struct sockaddr_in6 saddr_in6;
+	struct sockaddr_in saddr_in;
+	struct sockaddr * sa = (struct sockaddr *) &saddr_in6;
+	socklen_t salen = sizeof (saddr_in6);
+
+	/* dual stack socket receives both ipv4 and ipv6 */
+	memset (&saddr_in6, 0, sizeof (saddr_in6));
+	saddr_in6.sin6_family = AF_INET6;
+	saddr_in6.sin6_port = htons (DSTPORT);
+	saddr_in6.sin6_addr = in6addr_any;
+
+	if ((sock = socket (AF_INET6, SOCK_DGRAM, 0)) < 0) {
+		/* ipv6 is disabled */
+		memset (&saddr_in, 0, sizeof (saddr_in));
+		saddr_in.sin_family = AF_INET;
+		saddr_in.sin_port = htons (DSTPORT);
+		saddr_in.sin_addr.s_addr = INADDR_ANY;
+		sa = (struct sockaddr *) &saddr_in;
+		salen = sizeof (saddr_in);
+		sock = socket (AF_INET, SOCK_DGRAM, 0);
+	} else
+		setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY,
+			    &off, sizeof (off));
+
+	if (sock < 0) {
+		D ("failed to create receive UDP socket");
+		perror ("socket");
+		exit (1);
+	}
+	
+	if (IS_V())
+		D ("receive UDP socket is %d", sock);
+
+	if (bind (sock, sa, salen) < 0) {
+		D ("failed to bind receive socket");
+		perror ("bind");
+		exit (1);
+	}
+
+	return sock;
+}
+
+/* bounce packets to DSTPORT back to the sender in batches */
+void
+flowgen_reflect_udp (void)
+{
+	int sock, n, ret;
+	time_t now, last = 0;
+	unsigned long reflected = 0, prev = 0;
+	static char bufs[REFLECT_BATCH][PACKETMAXLEN];
+	struct sockaddr_storage names[REFLECT_BATCH];
+	struct iovec iovs[REFLECT_BATCH];
+	struct mmsghdr msgs[REFLECT_BATCH];
+
+	sock = flowgen_udp_bind_socket ();
+
+	memset (msgs, 0, sizeof (msgs));
+	for (n = 0; n < REFLECT_BATCH; n++) {
+		iovs[n].iov_base = bufs[n];
+		msgs[n].msg_hdr.msg_iov = &iovs[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		msgs[n].msg_hdr.msg_name = &names[n];
+	}
+
+	D ("reflecting udp packets...");
+	while (1) {
+		for (n = 0; n < REFLECT_BATCH; n++) {
+			iovs[n].iov_len = PACKETMAXLEN;
+			msgs[n].msg_hdr.msg_namelen = sizeof (names[n]);
+		}
+
+		ret = recvmmsg (sock, msgs, REFLECT_BATCH, MSG_WAITFORONE,
+				NULL);
+		if (ret < 0) {
+			D ("packet recv failed");
+			perror ("recvmmsg");
+			exit (1);
+		}
+
+		/* payload goes back as it is, from the same buffers */
+		for (n = 0; n < ret; n++)
+			iovs[n].iov_len = msgs[n].msg_len;
+
+		ret = sendmmsg (sock, msgs, ret, 0);
+		if (ret > 0)
+			reflected += ret;
+
+		now = time (NULL);
+		if (now != last) {
+			D ("[%lu] reflected %lu packets", now,
+			   reflected - prev);
+			last = now;
+			prev = reflected;
+		}
+	}
+}
+
+/* read reflected packets on the udp xmit socket (-u -a) */
+void *
+flowgen_rtt_thread (void * param)
+{
+	int ret;
+	char buf[PACKETMAXLEN];
+	time_t now, last = 0;
+	struct rtt_stat rtt;
+	struct pkt_info pi;
+	struct pollfd x[1];
+
+	memset (&rtt, 0, sizeof (rtt));
+	x[0].fd = flowgen.socket;
+	x[0].events = POLLIN;
+
+	while (1) {
+		if (poll (x, 1, POLLTIMEOUT) > 0) {
+			/* payload only, as if after a udp header */
+			ret = recv (flowgen.socket,
+				    buf + sizeof (struct udphdr),
+				    sizeof (buf) - sizeof (struct udphdr),
+				    MSG_DONTWAIT);
+			if (ret > 0) {
+				pi.udp = (struct udphdr *) buf;
+				pi.len = ret + sizeof (struct udphdr);
+				flowgen_rtt (&pi, nsec_now (), &rtt);
+			}
+		}
+
+		now = time (NULL);
+		if (now != last) {
+			rtt_stat_print (&rtt);
+			last = now;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Scenarios (-Z). A scenario file lists traffic classes, each with its
+ * own protocol, flows, distribution, size and rate. Every class runs
+ * in its own thread on kernel sockets from one start time, and the
+ * counters of all classes are printed together. Classes do not go
+ * through the xmit engine and its backends (-K, -a, -B, -T ...): tcp
+ * needs the kernel stack, and a class is paced by its own thread.
+ */
+
+#define CLASS_ADD(x, v)	__atomic_fetch_add (&(x), (v), __ATOMIC_RELAXED)
+#define CLASS_LOAD(x)	__atomic_load_n (&(x), __ATOMIC_RELAXED)
+
+static int
+class_parse (struct flowgen_class * c, char * line)
+{
+	int ret;
+	char proto[16], * tok, * save;
+
+	if (sscanf (line, "%31s %15s", c->name, proto) != 2)
+		return -1;
+
+	if (strcmp (proto, "udp") == 0) {
+		c->proto = CLASS_UDP;
+		c->port = DSTPORT;
+	} else if (strcmp (proto, "tcp") == 0) {
+		c->proto = CLASS_TCP;
+		c->port = TCPGEN_PORT;
+	} else {
+		D ("invalid protocol %s of class %s", proto, c->name);
+		return -1;
+	}
+
+	c->dst = flowgen.daddr;
+	c->flow_num = 1;
+	c->flow_dist = FLOWDIST_SAME;
+	dist_parse ("1010", &c->size);
+
+	strtok_r (line, " \t\n", &save);
+	strtok_r (NULL, " \t\n", &save);
+	while ((tok = strtok_r (NULL, " \t\n", &save)) != NULL) {
+		if (sscanf (tok, "flows=%d", &c->flow_num) == 1 &&
+		    0 < c->flow_num && c->flow_num <= CLASS_FLOW_MAX)
+			continue;
+		if (strncmp (tok, "dist=", 5) == 0 &&
+		    (ret = flow_dist_parse (tok + 5)) >= 0) {
+			c->flow_dist = ret;
+			continue;
+		}
+		if (strncmp (tok, "size=", 5) == 0 &&
+		    dist_parse (tok + 5, &c->size) == 0)
+			continue;
+		if (sscanf (tok, "rate=%lf", &c->rate) == 1 && c->rate >= 0)
+			continue;
+		if (sscanf (tok, "start=%lf", &c->start) == 1 &&
+		    c->start >= 0)
+			continue;
+		if (sscanf (tok, "duration=%lf", &c->duration) == 1 &&
+		    c->duration >= 0)
+			continue;
+		if (strncmp (tok, "dst=", 4) == 0 &&
+		    addr_parse (tok + 4, &c->dst) == 0)
+			continue;
+		if (sscanf (tok, "port=%d", &c->port) == 1 &&
+		    0 < c->port && c->port < 65536)
+			continue;
+		if (strcmp (tok, "rtt") == 0 && c->proto == CLASS_UDP) {
+			c->rtt = 1;
+			continue;
+		}
+		D ("invalid parameter %s of class %s", tok, c->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* lines are "duration SEC" or "NAME udp|tcp [KEY=VALUE ...]" */
+struct scenario *
+flowgen_scenario_parse (char * path)
+{
+	FILE * fp;
+	char line[1024];
+	struct scenario * s;
+
+	if ((fp = fopen (path, "r")) == NULL) {
+		D ("failed to open scenario file %s", path);
+		perror ("fopen");
+		return NULL;
+	}
+
+	if ((s = calloc (1, sizeof (*s))) == NULL) {
+		perror ("calloc");
+		fclose (fp);
+		return NULL;
+	}
+
+	while (fgets (line, sizeof (line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf (line, "duration %lf", &s->duration) == 1)
+			continue;
+		if (s->num == CLASS_MAX) {
+			D ("too many classes, max is %d", CLASS_MAX);
+			goto err;
+		}
+		if (class_parse (&s->c[s->num], line) < 0) {
+			D ("invalid line in %s: %s", path, line);
+			goto err;
+		}
+		s->num++;
+	}
+	fclose (fp);
+
+	if (!s->num) {
+		D ("no class in %s", path);
+		free (s);
+		return NULL;
+	}
+
+	return s;
+
+err:
+	fclose (fp);
+	free (s);
+	return NULL;
+}
+
+/* flows of a class weighted by its distribution, like -t */
+static void
+class_flow_list (struct flowgen_class * c)
+{
+	int n, i, num;
+	double w[CLASS_FLOW_MAX], sum = 0;
+
+	for (n = 0; n < c->flow_num; n++) {
+		switch (c->flow_dist) {
+		case FLOWDIST_RANDOM :
+			w[n] = fastrand_range (&c->rnd, FLOW_MAX) + 1;
+			break;
+		case FLOWDIST_DWER :
+			w[n] = POWERLAW ((double) (n + 1));
+			break;
+		default :
+			w[n] = 1;
+		}
+		sum += w[n];
+	}
+
+	c->list_len = 0;
+	for (n = 0; n < c->flow_num; n++) {
+		num = w[n] / sum * CLASS_LIST_LEN;
+		if (num == 0)
+			num = 1;
+		for (i = 0; i < num && c->list_len < CLASS_LIST_LEN; i++)
+			c->list[c->list_len++] = n;
+	}
+}
+
+static int
+class_socket (struct flowgen_class * c)
+{
+	int sock;
+	struct sockaddr_storage ss;
+	struct sockaddr_in * sin = (struct sockaddr_in *) &ss;
+	struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *) &ss;
+	socklen_t len;
+
+	memset (&ss, 0, sizeof (ss));
+	if (c->dst.af == AF_INET) {
+		sin->sin_family = AF_INET;
+		sin->sin_addr = c->dst.v4;
+		sin->sin_port = htons (c->port);
+		len = sizeof (*sin);
+	} else {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = c->dst.v6;
+		sin6->sin6_port = htons (c->port);
+		len = sizeof (*sin6);
+	}
+
+	sock = socket (c->dst.af, c->proto == CLASS_TCP ?
+		       SOCK_STREAM : SOCK_DGRAM, 0);
+	if (sock < 0) {
+		D ("failed to create socket for class %s", c->name);
+		perror ("socket");
+		exit (1);
+	}
+
+	/* each udp flow gets its own ephemeral source port */
+	if (connect (sock, (struct sockaddr *) &ss, len) < 0) {
+		D ("failed to connect for class %s", c->name);
+		perror ("connect");
+		exit (1);
+	}
+
+	/* non-blocking, a slow tcp flow must not stall the class */
+	if (fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK) < 0) {
+		perror ("fcntl");
+		exit (1);
+	}
+
+	return sock;
+}
+
+static void *
+class_rtt_thread (void * param)
+{
+	int n, ret;
+	char buf[PACKETMAXLEN];
+	struct flowgen_class * c = param;
+	struct pollfd x[CLASS_FLOW_MAX];
+	struct pkt_info pi;
+
+	for (n = 0; n < c->flow_num; n++) {
+		x[n].fd = c->socks[n];
+		x[n].events = POLLIN;
+	}
+
+	while (1) {
+		if (poll (x, c->flow_num, POLLTIMEOUT) <= 0)
+			continue;
+
+		for (n = 0; n < c->flow_num; n++) {
+			if (!(x[n].revents & POLLIN))
+				continue;
+			/* payload only, as if after a udp header */
+			ret = recv (x[n].fd, buf + sizeof (struct udphdr),
+				    sizeof (buf) - sizeof (struct udphdr),
+				    MSG_DONTWAIT);
+			if (ret <= 0)
+				continue;
+			pi.udp = (struct udphdr *) buf;
+			pi.len = ret + sizeof (struct udphdr);
+			flowgen_rtt (&pi, nsec_now (), &c->rtt_stat);
+		}
+	}
+
+	return NULL;
+}
+
+/* wait until a flow of the class can be written, or until end */
+static void
+class_wait (struct flowgen_class * c, u_int64_t end)
+{
+	int n, timeout = POLLTIMEOUT;
+	u_int64_t now = nsec_mono ();
+	struct pollfd x[CLASS_FLOW_MAX];
+
+	if (end && now >= end)
+		return;
+	if (end && (end - now) / 1000000 + 1 < timeout)
+		timeout = (end - now) / 1000000 + 1;
+
+	for (n = 0; n < c->flow_num; n++) {
+		x[n].fd = c->socks[n];
+		x[n].events = POLLOUT;
+	}
+	poll (x, c->flow_num, timeout);
+}
+
+static void *
+class_thread (void * param)
+{
+	int n, len, ret, max, blocked = 0;
+	u_int32_t seq[CLASS_FLOW_MAX];
+	u_int64_t now, next, end = 0;
+	static __thread char buf[CLASS_WRITE_MAX];
+	struct flowgen_class * c = param;
+	struct flowgen_hdr hdr;
+
+	max = c->proto == CLASS_UDP ? PACKETMAXLEN - 48 : CLASS_WRITE_MAX;
+	memset (seq, 0, sizeof (seq));
+
+	next = flowgen.scenario->start + c->start * 1e9;
+	pace_until (next);
+	c->begin = next;
+
+	if (c->duration)
+		end = next + c->duration * 1e9;
+	if (flowgen.scenario->end && (!end || end > flowgen.scenario->end))
+		end = flowgen.scenario->end;
+
+	while (c->alive) {
+		now = nsec_mono ();
+		if (end && now >= end)
+			break;
+
+		n = c->list[fastrand_range (&c->rnd, c->list_len)];
+		if (c->socks[n] < 0)
+			continue;
+		len = dist_draw (&c->size, &c->rnd);
+		if (len < 1)
+			len = 1;
+		if (len > max)
+			len = max;
+
+		if (c->rtt && len >= sizeof (hdr)) {
+			hdr.magic = htonl (FLOWGEN_MAGIC);
+			hdr.seq = htonl (seq[n]);
+			hdr.tstamp = htobe64 (nsec_now ());
+			memcpy (buf, &hdr, sizeof (hdr));
+		}
+
+		ret = send (c->socks[n], buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+		    c->proto == CLASS_TCP) {
+			/* socket buffer full, draw another flow */
+			if (++blocked >= c->flow_num) {
+				class_wait (c, end);
+				blocked = 0;
+			}
+			continue;
+		}
+		blocked = 0;
+
+		if (ret < 0) {
+			CLASS_ADD (c->errors, 1);
+			if (c->proto == CLASS_TCP) {
+				D ("class %s lost connection of flow %d",
+				   c->name, n);
+				close (c->socks[n]);
+				c->socks[n] = -1;
+				c->alive--;
+			}
+		} else {
+			seq[n]++;
+			CLASS_ADD (c->packets, 1);
+			CLASS_ADD (c->bytes, ret);
+		}
+
+		if (c->rate) {
+			next += 1e9 / c->rate;
+			/* do not burst to catch up after a stall */
+			if (next + PROFILE_TICK * 100 < now)
+				next = now;
+			pace_until (next);
+		}
+	}
+
+	c->stop = nsec_mono ();
+	if (end && c->stop > end)
+		c->stop = end;
+	__atomic_store_n (&c->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+class_print (char * prefix, struct flowgen_class * c,
+	     unsigned long packets, unsigned long bytes, double sec)
+{
+	int n, flows = 0;
+
+	for (n = 0; n < flowgen.scenario->num; n++)
+		flows += flowgen.scenario->c[n].flow_num;
+
+	if (sec <= 0)
+		sec = 1;
+
+	printf ("%s%-12s %-4s %6d %12.0f %12.3f %10lu", prefix,
+		c ? c->name : "total",
+		c ? (c->proto == CLASS_TCP ? "tcp" : "udp") : "",
+		c ? c->flow_num : flows, packets / sec,
+		bytes * 8 / sec / 1000000, c ? CLASS_LOAD (c->errors) : 0);
+	if (c && c->rtt_stat.count)
+		printf (" %10lu %10lu", c->rtt_stat.sum / c->rtt_stat.count,
+			rtt_stat_percentile (&c->rtt_stat, 99));
+	printf ("\n");
 }
 
 void
-flow_dist_init_power (void)
+flowgen_scenario (void)
+{
+	int n, f, running;
+	unsigned long packets, bytes, last_p[CLASS_MAX], last_b[CLASS_MAX];
+	unsigned long p, b;
+	u_int64_t begin, stop;
+	char prefix[32];
+	struct rlimit rl;
+	pthread_t tid;
+	struct scenario * s = flowgen.scenario;
+	struct flowgen_class * c;
+
+	/* a socket per flow */
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &rl);
+	}
+
+	for (n = 0; n < s->num; n++) {
+		c = &s->c[n];
+		fastrand_init (&c->rnd, flowgen.seed, 4 + n);
+		for (f = 0; f < c->flow_num; f++)
+			c->socks[f] = class_socket (c);
+		c->alive = c->flow_num;
+		class_flow_list (c);
+		if (IS_V())
+			D ("class %s: %d %s flows, %s, rate %.0f",
+			   c->name, c->flow_num,
+			   c->proto == CLASS_TCP ? "tcp" : "udp",
+			   flowgen_flow_dist_name[c->flow_dist], c->rate);
+	}
+
+	/* all classes start from the same time */
+	s->start = nsec_mono () + 100000000ULL;
+	s->end = s->duration ? s->start + s->duration * 1e9 : 0;
+
+	for (n = 0; n < s->num; n++) {
+		c = &s->c[n];
+		pthread_create (&c->tid, NULL, class_thread, c);
+		if (c->rtt) {
+			pthread_create (&tid, NULL, class_rtt_thread, c);
+			pthread_detach (tid);
+		}
+	}
+
+	memset (last_p, 0, sizeof (last_p));
+	memset (last_b, 0, sizeof (last_b));
+	pace_until (s->start);
+
+	printf ("%-12s %-12s %-4s %6s %12s %12s %10s %10s %10s\n", "",
+		"class", "", "flows", "pps", "Mbps", "errors",
+		"rtt avg", "rtt p99");
+	do {
+		sleep (1);
+		running = 0;
+		packets = bytes = 0;
+		snprintf (prefix, sizeof (prefix), "[%lu] ", time (NULL));
+		for (n = 0; n < s->num; n++) {
+			c = &s->c[n];
+			p = CLASS_LOAD (c->packets);
+			b = CLASS_LOAD (c->bytes);
+			class_print (prefix, c, p - last_p[n], b - last_b[n], 1);
+			packets += p - last_p[n];
+			bytes += b - last_b[n];
+			last_p[n] = p;
+			last_b[n] = b;
+			running += !__atomic_load_n (&c->done,
+						     __ATOMIC_ACQUIRE);
+		}
+		class_print (prefix, NULL, packets, bytes, 1);
+		fflush (stdout);
+	} while (running);
+
+	for (n = 0; n < s->num; n++)
+		pthread_join (s->c[n].tid, NULL);
+
+	/* average over the active interval of each class */
+	packets = bytes = 0;
+	begin = stop = 0;
+	printf ("\n%-12s %-4s %6s %12s %12s %10s %10s %10s\n",
+		"class", "", "flows", "avg pps", "avg Mbps", "errors",
+		"rtt avg", "rtt p99");
+	for (n = 0; n < s->num; n++) {
+		c = &s->c[n];
+		class_print ("", c, c->packets, c->bytes,
+			     (c->stop - c->begin) / 1e9);
+		packets += c->packets;
+		bytes += c->bytes;
+		if (!begin || c->begin < begin)
+			begin = c->begin;
+		if (c->stop > stop)
+			stop = c->stop;
+	}
+	class_print ("", NULL, packets, bytes, (stop - begin) / 1e9);
+
+	for (n = 0; n < s->num; n++) {
+		c = &s->c[n];
+		for (f = 0; f < c->flow_num; f++)
+			if (c->socks[f] >= 0)
+				close (c->socks[f]);
+	}
+}
+
+void *
+flowgen_receive_thread (void * param)
+{
+	int sock, ret, cnt;
+	char buf[2048];
+
+	D ("Init receive thread");
+
+	sock = flowgen_udp_bind_socket ();
+
+	cnt = 0;
+
+	D ("waiting packet...");
+	PROF_START ("recv", 0);
+	while (1) {
+
+		ret = recv (sock, buf, sizeof (buf), 0);
+		PROF_MARK (PROF_RX_RECV, 1);
+
+		if (ret < 0) {
+			D ("packet recv failed");
+			perror ("recv");
+			exit (1);
+		}
+
+		__atomic_fetch_add (&flowgen.rx_packets, 1, __ATOMIC_RELAXED);
+
+		if (IS_V())
+			D ("%d: [%lu] receive %d bytes packet", 
+			   ++cnt, time (NULL), ret);
+	}
+
+	return NULL;
+}
+
+/* find the flowgen udp header through vlans and tunnels. proto is the
+ * ethertype of p, ETH_P_TEB for an ethernet frame. */
+static int
+flowgen_parse (u_int8_t * p, int len, int proto, struct pkt_info * pi)
+{
+	int depth, hlen, nxt;
+	u_int16_t v[2];
+	struct ip * ip;
+	struct ip6_hdr * ip6;
+	struct udphdr * udp;
+
+	memset (pi, 0, sizeof (*pi));
+
+	for (depth = 0; depth < 8; depth++) {
+
+		/* layer 2 and 2.5 */
+		switch (proto) {
+		case ETH_P_TEB :
+			if (len < ETH_HLEN)
+				return -1;
+			memcpy (v, p + 12, sizeof (v[0]));
+			proto = ntohs (v[0]);
+			p += ETH_HLEN;
+			len -= ETH_HLEN;
+			while (proto == ETH_P_8021Q || proto == ETH_P_8021AD) {
+				if (len < 4)
+					return -1;
+				memcpy (v, p + 2, sizeof (v[0]));
+				proto = ntohs (v[0]);
+				p += 4;
+				len -= 4;
+			}
+			continue;
+
+		case ETH_P_MPLS_UC :
+			/* skip labels to the bottom of stack */
+			do {
+				if (len < 4)
+					return -1;
+				p += 4;
+				len -= 4;
+			} while (!(p[-2] & 0x01));
+			if (len < 1)
+				return -1;
+			proto = (p[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP;
+			continue;
+
+		case ETH_P_IP :
+			ip = (struct ip *) p;
+			if (len < (int) sizeof (*ip))
+				return -1;
+			if (!pi->outer_l3) {
+				pi->outer_af = AF_INET;
+				pi->outer_l3 = p;
+			}
+			if (ip->ip_off & htons (IP_MF | IP_OFFMASK))
+				return -1;
+			hlen = ip->ip_hl * 4;
+			if (ntohs (ip->ip_len) < len)
+				len = ntohs (ip->ip_len);
+			if (ip->ip_hl < 5 || hlen > len)
+				return -1;
+			pi->af = AF_INET;
+			pi->l3 = p;
+			nxt = ip->ip_p;
+			break;
+
+		case ETH_P_IPV6 :
+			ip6 = (struct ip6_hdr *) p;
+			if (len < (int) sizeof (*ip6))
+				return -1;
+			if (!pi->outer_l3) {
+				pi->outer_af = AF_INET6;
+				pi->outer_l3 = p;
+			}
+			hlen = sizeof (*ip6);
+			if (ntohs (ip6->ip6_plen) + hlen < len)
+				len = ntohs (ip6->ip6_plen) + hlen;
+			pi->af = AF_INET6;
+			pi->l3 = p;
+			nxt = ip6->ip6_nxt;
+			break;
+
+		default :
+			return -1;
+		}
+
+		p += hlen;
+		len -= hlen;
+
+		/* layer 4 */
+		switch (nxt) {
+		case IPPROTO_UDP :
+			udp = (struct udphdr *) p;
+			if (len < (int) sizeof (*udp))
+				return -1;
+			switch (ntohs (udp->uh_dport)) {
+			case DSTPORT :
+				pi->udp = udp;
+				pi->len = len;
+				return 0;
+			case VXLANPORT :
+				if (len < (int) sizeof (*udp) + 8)
+					return -1;
+				p += sizeof (*udp) + 8;
+				len -= sizeof (*udp) + 8;
+				proto = ETH_P_TEB;
+				break;
+			case MPLSUDPPORT :
+				p += sizeof (*udp);
+				len -= sizeof (*udp);
+				proto = ETH_P_MPLS_UC;
+				break;
+			default :
+				if (ntohs (udp->uh_sport) != DSTPORT)
+					return -1;
+				pi->udp = udp;
+				pi->len = len;
+				pi->reflected = 1;
+				return 0;
+			}
+			break;
+
+		case IPPROTO_GRE :
+			if (len < 4)
+				return -1;
+			memcpy (v, p, sizeof (v));
+			hlen = 4;
+			hlen += (ntohs (v[0]) & 0x8000) ? 4 : 0;   /* C */
+			hlen += (ntohs (v[0]) & 0x2000) ? 4 : 0;   /* K */
+			hlen += (ntohs (v[0]) & 0x1000) ? 4 : 0;   /* S */
+			if (hlen > len)
+				return -1;
+			proto = ntohs (v[1]);
+			p += hlen;
+			len -= hlen;
+			break;
+
+		case IPPROTO_IPIP :
+			proto = ETH_P_IP;
+			break;
+
+		case IPPROTO_IPV6 :
+			proto = ETH_P_IPV6;
+			break;
+
+		default :
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+static inline void
+swap_bytes (u_int8_t * a, u_int8_t * b, int len)
+{
+	u_int8_t tmp[16];
+
+	memcpy (tmp, a, len);
+	memcpy (a, b, len);
+	memcpy (b, tmp, len);
+}
+
+static inline void
+swap_l3_l4 (int af, u_int8_t * l3, struct udphdr * udp)
+{
+	/* checksums do not change by swapping */
+	if (af == AF_INET)
+		swap_bytes ((u_int8_t *) &((struct ip *) l3)->ip_src,
+			    (u_int8_t *) &((struct ip *) l3)->ip_dst, 4);
+	else
+		swap_bytes ((u_int8_t *) &((struct ip6_hdr *) l3)->ip6_src,
+			    (u_int8_t *) &((struct ip6_hdr *) l3)->ip6_dst,
+			    16);
+	if (udp)
+		swap_bytes ((u_int8_t *) &udp->uh_sport,
+			    (u_int8_t *) &udp->uh_dport, 2);
+}
+
+/* turn a received frame around in place. udp ports of a tunnel are
+ * left alone, its dport is the well-known port of the encapsulation */
+static void
+flowgen_swap (u_int8_t * frame, struct pkt_info * pi)
 {
+	swap_bytes (frame, frame + ETH_ALEN, ETH_ALEN);
+	if (pi->l3 != pi->outer_l3)
+		swap_l3_l4 (pi->outer_af, pi->outer_l3, NULL);
+	swap_l3_l4 (pi->af, pi->l3, pi->udp);
+}
 
-	/* The ratio of lows follows Power Law */
+void *
+flowgen_ring_thread (void * param)
+{
+	unsigned int b = 0, n, num, nref, out;
+	unsigned long bytes, fg;
+	u_int8_t * frame;
+	struct rx_ring * r = param;
+	struct iovec iovs[REFLECT_BATCH];
+	struct mmsghdr msgs[REFLECT_BATCH];
+	struct tpacket_block_desc * pbd;
+	struct tpacket3_hdr * ppd;
+	struct sockaddr_ll * sll;
+	struct pkt_info pi;
+	struct pollfd x[1];
 
-	int n, i, plen = 0, port = 0;
-	float sum = 0;
+	x[0].fd = r->sock;
+	x[0].events = POLLIN | POLLERR;
 
-	struct flow {
-		float throughput;
-		float ratio;
-	} flows[FLOW_MAX];
-		
+	memset (msgs, 0, sizeof (msgs));
+	for (n = 0; n < REFLECT_BATCH; n++) {
+		msgs[n].msg_hdr.msg_iov = &iovs[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
 
-	for (n = 0; n < flowgen.flow_num; n++) {
-		flows[n].throughput = POWERLAW (n);
-		sum += flows[n].throughput;
+	PROF_START ("ring", r->index);
+	while (1) {
+		pbd = (struct tpacket_block_desc *)
+			(r->map + b * r->req.tp_block_size);
+
+		if (!(__atomic_load_n (&pbd->hdr.bh1.block_status,
+				       __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			poll (x, 1, POLLTIMEOUT);
+			PROF_MARK (PROF_RX_WAIT, 0);
+			continue;
+		}
+
+		/* parse packets in place */
+		num = pbd->hdr.bh1.num_pkts;
+		bytes = fg = nref = out = 0;
+		ppd = (struct tpacket3_hdr *)
+			((u_int8_t *) pbd + pbd->hdr.bh1.offset_to_first_pkt);
+
+		for (n = 0; n < num; n++) {
+			sll = (struct sockaddr_ll *)
+				((u_int8_t *) ppd +
+				 TPACKET_ALIGN (sizeof (*ppd)));
+			frame = (u_int8_t *) ppd + ppd->tp_mac;
+			if (sll->sll_pkttype != PACKET_OUTGOING) {
+				bytes += ppd->tp_len;
+				if (flowgen_parse (frame, ppd->tp_snaplen,
+						   ETH_P_TEB, &pi) == 0)
+					fg++;
+				else
+					pi.udp = NULL;
+			} else {
+				out++;	/* our own xmit, not received */
+				pi.udp = NULL;
+			}
+
+			if (pi.udp && pi.reflected && flowgen.tstamp)
+				flowgen_rtt (&pi, ppd->tp_sec * 1000000000ULL +
+					     ppd->tp_nsec, &r->rtt);
+
+			/* send back in place from the ring */
+			if (flowgen.reflect && pi.udp && !pi.reflected &&
+			    ppd->tp_snaplen == ppd->tp_len) {
+				flowgen_swap (frame, &pi);
+				iovs[nref].iov_base = frame;
+				iovs[nref].iov_len = ppd->tp_snaplen;
+				if (++nref == REFLECT_BATCH) {
+					sendmmsg (r->sock, msgs, nref, 0);
+					__atomic_fetch_add (&r->reflected, nref,
+							    __ATOMIC_RELAXED);
+					nref = 0;
+				}
+			}
+
+			ppd = (struct tpacket3_hdr *)
+				((u_int8_t *) ppd + ppd->tp_next_offset);
+		}
+
+		if (nref) {
+			sendmmsg (r->sock, msgs, nref, 0);
+			__atomic_fetch_add (&r->reflected, nref,
+					    __ATOMIC_RELAXED);
+		}
+
+		num -= out;
+		__atomic_fetch_add (&r->packets, num, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&r->bytes, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&r->fg_packets, fg, __ATOMIC_RELAXED);
+		PROF_MARK (PROF_RX_PARSE, num);
+
+		if (IS_V())
+			D ("ring %d: block %u has %u packets, %lu flowgen",
+			   r->index, b, num, fg);
+
+		__atomic_store_n (&pbd->hdr.bh1.block_status,
+				  TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		b = (b + 1) % r->req.tp_block_nr;
 	}
 
-	for (n = 0; n < flowgen.flow_num; n++) {
-		flows[n].ratio =
-			(int) (flows[n].throughput / sum * PORTLISTLEN);
-		if (flows[n].ratio == 0)
-			flows[n].ratio = 1;
+	return NULL;
+}
+
+void
+flowgen_ring_init (struct rx_ring * r, int ifindex)
+{
+	int ver = TPACKET_V3, fanout;
+	size_t size;
+	struct sockaddr_ll sll;
+	struct packet_mreq mr;
+
+	if ((r->sock = socket (AF_PACKET, SOCK_RAW, htons (ETH_P_ALL))) < 0) {
+		D ("failed to create packet socket");
+		perror ("socket");
+		exit (1);
 	}
 
-	int psum = 0;
-	for (n = 0; n < flowgen.flow_num; n++) {
+	if (setsockopt (r->sock, SOL_PACKET, PACKET_VERSION,
+			&ver, sizeof (ver)) < 0) {
+		D ("failed to set TPACKET_V3");
+		perror ("setsockopt");
+		exit (1);
+	}
 
-		D ("Flow %2d ratio is %f%%", n,
-		   flows[n].ratio / PORTLISTLEN * 100);
-		psum += flows[n].ratio / PORTLISTLEN * 100;
+	memset (&r->req, 0, sizeof (r->req));
+	r->req.tp_block_size = RING_BLOCK_SIZE;
+	r->req.tp_block_nr = RING_BLOCK_NUM;
+	r->req.tp_frame_size = RING_FRAME_SIZE;
+	r->req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE *
+		RING_BLOCK_NUM;
+	r->req.tp_retire_blk_tov = RING_TIMEOUT;
+
+	if (setsockopt (r->sock, SOL_PACKET, PACKET_RX_RING,
+			&r->req, sizeof (r->req)) < 0) {
+		D ("failed to set PACKET_RX_RING");
+		perror ("setsockopt");
+		exit (1);
+	}
 
-		for (i = 0; i < (int)flows[n].ratio; i++) {
-			flowgen.port_list[plen++] = 
-				flowgen.port_candidates[port];
-		}
-		port++;
+	size = (size_t) r->req.tp_block_size * r->req.tp_block_nr;
+	r->map = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->sock, 0);
+	if (r->map == MAP_FAILED) {
+		D ("failed to mmap rx ring");
+		perror ("mmap");
+		exit (1);
 	}
-	
-	D ("Sum is %d%%, port list len is %d\n", psum, plen);
 
-	flowgen.port_list_len = plen;
+	memset (&sll, 0, sizeof (sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons (ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind (r->sock, (struct sockaddr *) &sll, sizeof (sll)) < 0) {
+		D ("failed to bind packet socket");
+		perror ("bind");
+		exit (1);
+	}
+
+	/* see traffic not destined to this host */
+	memset (&mr, 0, sizeof (mr));
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	setsockopt (r->sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		    &mr, sizeof (mr));
+
+	if (flowgen.rx_threads > 1) {
+		fanout = (getpid () & 0xFFFF) | (flowgen.rx_fanout << 16);
+		if (setsockopt (r->sock, SOL_PACKET, PACKET_FANOUT,
+				&fanout, sizeof (fanout)) < 0) {
+			D ("failed to join fanout group");
+			perror ("setsockopt");
+			exit (1);
+		}
+	}
 
 	return;
+}
 
+/* print counters of all rx rings every second */
+static void
+flowgen_rx_report (void)
+{
+	int n;
+	unsigned long pkts, bytes, fg, ppkts = 0, pbytes = 0, pfg = 0;
+	unsigned long ref, pref = 0;
+	struct rx_ring * r;
+	struct rtt_stat rtt;
+
+	D ("waiting packet...");
+	while (1) {
+		sleep (1);
+
+		pkts = bytes = fg = ref = 0;
+		memset (&rtt, 0, sizeof (rtt));
+		for (n = 0; n < flowgen.rx_threads; n++) {
+			r = &flowgen.rx_rings[n];
+			ref += __atomic_load_n (&r->reflected,
+						__ATOMIC_RELAXED);
+			rtt_stat_merge (&rtt, &r->rtt);
+			pkts += __atomic_load_n (&r->packets,
+						 __ATOMIC_RELAXED);
+			bytes += __atomic_load_n (&r->bytes,
+						  __ATOMIC_RELAXED);
+			fg += __atomic_load_n (&r->fg_packets,
+					       __ATOMIC_RELAXED);
+		}
+
+		D ("[%lu] rx %lu pps %lu bps, flowgen %lu pps",
+		   time (NULL), pkts - ppkts, (bytes - pbytes) * 8, fg - pfg);
+		if (flowgen.reflect)
+			D ("reflected %lu pps", ref - pref);
+		rtt_stat_print (&rtt);
+		pref = ref;
+		ppkts = pkts;
+		pbytes = bytes;
+		pfg = fg;
+	}
 }
 
-void
-flowgen_start (void)
+void *
+flowgen_ring_receive_thread (void * param)
 {
-	int n, ret;
-	struct udphdr * udp;
+	int n, ifindex;
+	struct rx_ring * r;
 
-	udp = (struct udphdr *) (flowgen.pkt + sizeof (struct ip));
+	D ("Init %d receive rings on %s", flowgen.rx_threads,
+	   flowgen.rx_ifname);
 
-	if (flowgen.count) {
-		D ("xmit %d packets", flowgen.count);
+	if ((ifindex = if_nametoindex (flowgen.rx_ifname)) == 0) {
+		D ("invalid interface %s", flowgen.rx_ifname);
+		exit (1);
 	}
 
-	while (1) {
-		for (n = 0; n < flowgen.port_list_len; n++) {
-			udp->uh_sport = htons (flowgen.port_list[n]);
+	for (n = 0; n < flowgen.rx_threads; n++) {
+		r = &flowgen.rx_rings[n];
+		r->index = n;
+		flowgen_ring_init (r, ifindex);
+		pthread_create (&r->tid, NULL, flowgen_ring_thread, r);
+		pthread_detach (r->tid);
+		flowgen_pin (r->tid, 1 + n);
+	}
 
-			ret = sendto (flowgen.socket, flowgen.pkt,
-				      flowgen.pkt_len, 0,
-				      (struct sockaddr *) &flowgen.saddr_in,
-				      sizeof (struct sockaddr_in));
+	flowgen_rx_report ();
 
-			if (IS_V()) {
-				time_t now;
-				now = time (NULL);
-				D ("[%lu] %d: send %d bytes port %d",
-				   now, ++cnt, ret, flowgen.port_list[n]);
-			}
+	return NULL;
+}
 
-			if (flowgen.count) {
-				flowgen.count--;
-				if (flowgen.count == 0) 
-					exit (1);
-			}
+#ifdef FLOWGEN_DPDK
+/* poll an rx queue of the dpdk port, as flowgen_ring_thread () */
+static void *
+flowgen_dpdk_rx_thread (void * param)
+{
+	int n, num;
+	unsigned long bytes, fg;
+	struct rx_ring * r = param;
+	struct rte_mbuf * pkts[DPDK_BURST];
+	struct pkt_info pi;
 
-			if (ret < 0) {
-				perror ("send");
-				break;
-			}
+	/* an lcore id for the mempool cache */
+	rte_thread_register ();
+
+	PROF_START ("dpdk rx", r->index);
+	while (1) {
+		num = rte_eth_rx_burst (dpdk.port, r->index, pkts, DPDK_BURST);
+		if (!num) {
+			PROF_MARK (PROF_RX_WAIT, 0);
+			continue;
+		}
 
-			if (flowgen.interval)
-				usleep (flowgen.interval);
+		for (n = 0, bytes = fg = 0; n < num; n++) {
+			bytes += rte_pktmbuf_pkt_len (pkts[n]);
+			if (flowgen_parse (rte_pktmbuf_mtod (pkts[n],
+							     u_int8_t *),
+					   rte_pktmbuf_data_len (pkts[n]),
+					   ETH_P_TEB, &pi) < 0)
+				continue;
+			fg++;
+			if (pi.reflected && flowgen.tstamp)
+				flowgen_rtt (&pi, nsec_now (), &r->rtt);
 		}
+		rte_pktmbuf_free_bulk (pkts, num);
+
+		__atomic_fetch_add (&r->packets, num, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&r->bytes, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&r->fg_packets, fg, __ATOMIC_RELAXED);
+		PROF_MARK (PROF_RX_PARSE, num);
 	}
 
-	return;
+	return NULL;
 }
 
-void
-flowgen_udp_start (void)
+void *
+flowgen_dpdk_receive_thread (void * param)
 {
-	int n, ret, len;
-	char * pkt;
+	int n;
+	struct rx_ring * r;
+
+	D ("Init %d receive queues on dpdk port %u", flowgen.rx_threads,
+	   dpdk.port);
+
+	for (n = 0; n < flowgen.rx_threads; n++) {
+		r = &flowgen.rx_rings[n];
+		r->index = n;
+		pthread_create (&r->tid, NULL, flowgen_dpdk_rx_thread, r);
+		pthread_detach (r->tid);
+		flowgen_pin (r->tid, 1 + n);
+	}
 
-#ifdef POLL
-	struct pollfd x[1];
-	x[0].fd = flowgen.socket;
-	x[0].events = POLLOUT;
-#endif
+	flowgen_rx_report ();
+
+	return NULL;
+}
+#endif /* FLOWGEN_DPDK */
+
+/* instructions of the xdp sink, as in linux samples/bpf/bpf_insn.h */
+#define BPF_RAW(c, d, s, o, i)						\
+	((struct bpf_insn) {						\
+		.code = c, .dst_reg = d, .src_reg = s, .off = o, .imm = i })
+#define ALU64_IMM(op, d, i)	BPF_RAW (BPF_ALU64 | op | BPF_K, d, 0, 0, i)
+#define ALU64_REG(op, d, s)	BPF_RAW (BPF_ALU64 | op | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)		ALU64_IMM (BPF_MOV, d, i)
+#define MOV64_REG(d, s)		ALU64_REG (BPF_MOV, d, s)
+#define BE16(d)			BPF_RAW (BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LDX(sz, d, s, o)	BPF_RAW (BPF_LDX | sz | BPF_MEM, d, s, o, 0)
+#define STX(sz, d, s, o)	BPF_RAW (BPF_STX | sz | BPF_MEM, d, s, o, 0)
+#define ST(sz, d, o, i)		BPF_RAW (BPF_ST | sz | BPF_MEM, d, 0, o, i)
+#define JMP_IMM(op, d, i, o)	BPF_RAW (BPF_JMP | op | BPF_K, d, 0, o, i)
+#define JMP_REG(op, d, s, o)	BPF_RAW (BPF_JMP | op | BPF_X, d, s, o, 0)
+#define JA(o)			BPF_RAW (BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)			BPF_RAW (BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()			BPF_RAW (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd)						\
+	BPF_RAW (BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+	BPF_RAW (0, 0, 0, 0, 0)
+
+static int
+sys_bpf (int cmd, union bpf_attr * attr)
+{
+	return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+static int
+nr_possible_cpus (void)
+{
+	int min, max;
+	FILE * fp;
+
+	fp = fopen ("/sys/devices/system/cpu/possible", "r");
+	if (!fp)
+		return sysconf (_SC_NPROCESSORS_CONF);
+	if (fscanf (fp, "%d-%d", &min, &max) != 2)
+		max = min;
+	fclose (fp);
 
-	pkt = (char *) (flowgen.pkt + sizeof (struct ip) + 
-			sizeof (struct udphdr));
-	len = flowgen.pkt_len - sizeof (struct ip) - sizeof (struct udphdr);
+	return max + 1;
+}
 
-	if (flowgen.count) {
-		D ("xmit %d packets", flowgen.count);
+/* load the xdp sink counting udp packets to DSTPORT per source
+ * address and port, and dropping them. returns the prog fd. */
+int
+flowgen_xdp_load (int map_fd)
+{
+	int fd;
+	char log[8192];
+	union bpf_attr attr;
+
+	/* r2 data, r3 data_end, r9 length, key at fp-24, value at fp-40 */
+	struct bpf_insn prog[] = {
+		/* 0: ether */
+		LDX (BPF_W, 2, 1, offsetof (struct xdp_md, data)),
+		LDX (BPF_W, 3, 1, offsetof (struct xdp_md, data_end)),
+		MOV64_REG (4, 2),
+		ALU64_IMM (BPF_ADD, 4, ETH_HLEN),
+		JMP_REG (BPF_JGT, 4, 3, 76),			/* pass */
+		LDX (BPF_H, 5, 2, 12),
+		JMP_IMM (BPF_JEQ, 5, htons (ETH_P_IPV6), 23),	/* ipv6 */
+		JMP_IMM (BPF_JNE, 5, htons (ETH_P_IP), 73),	/* pass */
+
+		/* 8: ipv4 */
+		MOV64_REG (4, 2),
+		ALU64_IMM (BPF_ADD, 4, ETH_HLEN + 20),
+		JMP_REG (BPF_JGT, 4, 3, 70),			/* pass */
+		LDX (BPF_B, 5, 2, ETH_HLEN + 9),
+		JMP_IMM (BPF_JNE, 5, IPPROTO_UDP, 68),		/* pass */
+		LDX (BPF_H, 5, 2, ETH_HLEN + 6),
+		ALU64_IMM (BPF_AND, 5, htons (IP_MF | IP_OFFMASK)),
+		JMP_IMM (BPF_JNE, 5, 0, 65),			/* pass */
+		LDX (BPF_W, 5, 2, ETH_HLEN + 12),
+		STX (BPF_W, 10, 5, -24),
+		ST (BPF_W, 10, -20, 0),
+		ST (BPF_DW, 10, -16, 0),
+		ST (BPF_H, 10, -6, 4),
+		LDX (BPF_H, 9, 2, ETH_HLEN + 2),
+		BE16 (9),
+		ALU64_IMM (BPF_ADD, 9, ETH_HLEN),
+		LDX (BPF_B, 5, 2, ETH_HLEN),
+		ALU64_IMM (BPF_AND, 5, 0x0F),
+		ALU64_IMM (BPF_LSH, 5, 2),
+		ALU64_REG (BPF_ADD, 2, 5),
+		ALU64_IMM (BPF_ADD, 2, ETH_HLEN),
+		JA (18),					/* udp */
+
+		/* 30: ipv6 */
+		MOV64_REG (4, 2),
+		ALU64_IMM (BPF_ADD, 4, ETH_HLEN + 40),
+		JMP_REG (BPF_JGT, 4, 3, 48),			/* pass */
+		LDX (BPF_B, 5, 2, ETH_HLEN + 6),
+		JMP_IMM (BPF_JNE, 5, IPPROTO_UDP, 46),		/* pass */
+		LDX (BPF_W, 5, 2, ETH_HLEN + 8),
+		STX (BPF_W, 10, 5, -24),
+		LDX (BPF_W, 5, 2, ETH_HLEN + 12),
+		STX (BPF_W, 10, 5, -20),
+		LDX (BPF_W, 5, 2, ETH_HLEN + 16),
+		STX (BPF_W, 10, 5, -16),
+		LDX (BPF_W, 5, 2, ETH_HLEN + 20),
+		STX (BPF_W, 10, 5, -12),
+		ST (BPF_H, 10, -6, 6),
+		LDX (BPF_H, 9, 2, ETH_HLEN + 4),
+		BE16 (9),
+		ALU64_IMM (BPF_ADD, 9, ETH_HLEN + 40),
+		ALU64_IMM (BPF_ADD, 2, ETH_HLEN + 40),
+
+		/* 48: udp */
+		MOV64_REG (4, 2),
+		ALU64_IMM (BPF_ADD, 4, 8),
+		JMP_REG (BPF_JGT, 4, 3, 30),			/* pass */
+		LDX (BPF_H, 5, 2, 2),
+		JMP_IMM (BPF_JNE, 5, htons (DSTPORT), 28),	/* pass */
+		LDX (BPF_H, 5, 2, 0),
+
+		/* 54: sport completes the key, then count */
+		STX (BPF_H, 10, 5, -8),
+		LD_MAP_FD (1, map_fd),
+		MOV64_REG (2, 10),
+		ALU64_IMM (BPF_ADD, 2, -24),
+		CALL (BPF_FUNC_map_lookup_elem),
+		JMP_IMM (BPF_JEQ, 0, 0, 8),			/* insert */
+		LDX (BPF_DW, 1, 0, 0),
+		ALU64_IMM (BPF_ADD, 1, 1),
+		STX (BPF_DW, 0, 1, 0),
+		LDX (BPF_DW, 1, 0, 8),
+		ALU64_REG (BPF_ADD, 1, 9),
+		STX (BPF_DW, 0, 1, 8),
+		MOV64_IMM (0, XDP_DROP),
+		EXIT (),
+
+		/* 69: insert */
+		ST (BPF_DW, 10, -40, 1),
+		STX (BPF_DW, 10, 9, -32),
+		LD_MAP_FD (1, map_fd),
+		MOV64_REG (2, 10),
+		ALU64_IMM (BPF_ADD, 2, -24),
+		MOV64_REG (3, 10),
+		ALU64_IMM (BPF_ADD, 3, -40),
+		MOV64_IMM (4, BPF_ANY),
+		CALL (BPF_FUNC_map_update_elem),
+		MOV64_IMM (0, XDP_DROP),
+		EXIT (),
+
+		/* 81: pass */
+		MOV64_IMM (0, XDP_PASS),
+		EXIT (),
+	};
+
+	memset (&attr, 0, sizeof (attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long) prog;
+	attr.insn_cnt = sizeof (prog) / sizeof (prog[0]);
+	attr.license = (unsigned long) "GPL";
+	attr.log_buf = (unsigned long) log;
+	attr.log_size = sizeof (log);
+	attr.log_level = 1;
+	log[0] = '\0';
+
+	if ((fd = sys_bpf (BPF_PROG_LOAD, &attr)) < 0) {
+		D ("failed to load xdp program\n%s", log);
+		perror ("bpf");
+		exit (1);
 	}
 
-	while (1) {
-		for (n = 0; n < flowgen.port_list_len; n++) {
-#ifdef POLL
-			poll (x, 1, -1);
-#endif
+	return fd;
+}
 
-#ifdef UDPCONNECT
-			ret = write (flowgen.socket, pkt, len);
-#else
-			ret = sendto (flowgen.socket, pkt, len, 0,
-				      (struct sockaddr *) &flowgen.saddr_in,
-				      sizeof (struct sockaddr_in));
-#endif
+static volatile sig_atomic_t xdp_stop = 0;
 
-			if (IS_V()) {
-				time_t now;
-				now = time (NULL);
-				D ("[%lu] %d: send %d bytes port %d",
-				   now, ++cnt, ret, flowgen.port_list[n]);
-			}
+static void
+flowgen_xdp_sig (int sig)
+{
+	xdp_stop = 1;
+}
 
-			if (flowgen.count) {
-				flowgen.count--;
-				if (flowgen.count == 0) 
-					exit (1);
-			}
+/* sum the per cpu counters. dump each flow if dump is set */
+static void
+flowgen_xdp_read (int map_fd, int ncpus, int dump,
+		  u_int64_t * pkts, u_int64_t * bytes)
+{
+	int n, first = 1;
+	char addr[INET6_ADDRSTRLEN];
+	u_int64_t fp, fb;
+	union bpf_attr attr;
+	struct xdp_flow_key key, next;
+	struct xdp_flow_val val[ncpus];
 
-			if (ret < 0) {
-				perror ("send");
-				break;
-			}
+	*pkts = *bytes = 0;
 
-			if (flowgen.interval)
-				usleep (flowgen.interval);
+	while (1) {
+		memset (&attr, 0, sizeof (attr));
+		attr.map_fd = map_fd;
+		attr.key = first ? 0 : (unsigned long) &key;
+		attr.next_key = (unsigned long) &next;
+		if (sys_bpf (BPF_MAP_GET_NEXT_KEY, &attr) < 0)
+			break;
+		first = 0;
+		key = next;
+
+		memset (&attr, 0, sizeof (attr));
+		attr.map_fd = map_fd;
+		attr.key = (unsigned long) &key;
+		attr.value = (unsigned long) val;
+		if (sys_bpf (BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+			continue;
+
+		for (n = 0, fp = 0, fb = 0; n < ncpus; n++) {
+			fp += val[n].packets;
+			fb += val[n].bytes;
+		}
+		*pkts += fp;
+		*bytes += fb;
+
+		if (dump) {
+			inet_ntop (key.ipv == 6 ? AF_INET6 : AF_INET,
+				   key.saddr, addr, sizeof (addr));
+			D ("flow %s port %u: %lu packets %lu bytes",
+			   addr, ntohs (key.sport), fp, fb);
 		}
 	}
-
-	return;
 }
 
-
 void *
-flowgen_receive_thread (void * param)
+flowgen_xdp_receive_thread (void * param)
 {
-	int sock, ret, cnt;
-	char buf[2048];
-	struct sockaddr_in saddr_in;
-
-	D ("Init receive thread");
+	int ifindex, map_fd, prog_fd, link_fd, ncpus;
+	u_int64_t pkts, bytes, ppkts = 0, pbytes = 0;
+	union bpf_attr attr;
 
-	if ((sock = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
-		D ("failed to create receive UDP socket");
-		perror ("socket");
+	if ((ifindex = if_nametoindex (flowgen.rx_ifname)) == 0) {
+		D ("invalid interface %s", flowgen.rx_ifname);
 		exit (1);
 	}
-	
-	if (IS_V())
-		D ("receive UDP socket is %d", sock);
 
+	ncpus = nr_possible_cpus ();
 
-	memset (&saddr_in, 0, sizeof (saddr_in));
-	saddr_in.sin_family = AF_INET;
-	saddr_in.sin_port = htons (DSTPORT);
-	saddr_in.sin_addr.s_addr = INADDR_ANY;
-	
-	if (bind (sock, (struct sockaddr *)&saddr_in, sizeof (saddr_in)) < 0) {
-		D ("failed to bind receive socket");
-		perror ("bind");
+	memset (&attr, 0, sizeof (attr));
+	attr.map_type = BPF_MAP_TYPE_PERCPU_HASH;
+	attr.key_size = sizeof (struct xdp_flow_key);
+	attr.value_size = sizeof (struct xdp_flow_val);
+	attr.max_entries = XDP_FLOW_MAX;
+	if ((map_fd = sys_bpf (BPF_MAP_CREATE, &attr)) < 0) {
+		D ("failed to create xdp flow map");
+		perror ("bpf");
 		exit (1);
 	}
 
-	cnt = 0;
+	prog_fd = flowgen_xdp_load (map_fd);
+
+	/* native mode if the driver supports, otherwise generic. the
+	 * program is detached when the link fd is closed at exit. */
+	memset (&attr, 0, sizeof (attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	if ((link_fd = sys_bpf (BPF_LINK_CREATE, &attr)) < 0) {
+		D ("failed to attach xdp program to %s", flowgen.rx_ifname);
+		perror ("bpf");
+		exit (1);
+	}
 
-	D ("waiting packet...");
-	while (1) {
+	signal (SIGINT, flowgen_xdp_sig);
+	signal (SIGTERM, flowgen_xdp_sig);
 
-		ret = recv (sock, buf, sizeof (buf), 0);
-		
-		if (ret < 0) {
-			D ("packet recv failed");
-			perror ("recv");
-			exit (1);
-		}
+	D ("xdp sink is attached to %s", flowgen.rx_ifname);
+	while (!xdp_stop) {
+		sleep (1);
 
-		if (IS_V())
-			D ("%d: [%lu] receive %d bytes packet", 
-			   ++cnt, time (NULL), ret);
+		flowgen_xdp_read (map_fd, ncpus, IS_V(), &pkts, &bytes);
+		D ("[%lu] rx %lu pps %lu bps by xdp", time (NULL),
+		   pkts - ppkts, (bytes - pbytes) * 8);
+		ppkts = pkts;
+		pbytes = bytes;
 	}
 
+	/* export per flow counters */
+	flowgen_xdp_read (map_fd, ncpus, 1, &pkts, &bytes);
+	D ("total %lu packets %lu bytes", pkts, bytes);
+
+	close (link_fd);
+	close (prog_fd);
+	close (map_fd);
+	exit (0);
+
 	return NULL;
 }
 
 int
 main (int argc, char ** argv)
 {
-	int ch, ret, f_flag = 0;
+	int ch, ret, f_flag = 0, s_flag = 0, d_flag = 0;
 	unsigned long random_seed = 0;
 	char * progname = argv[0];
 	pthread_t tid;
+	void * (* receive_thread) (void *) = flowgen_receive_thread;
 
 	flowgen_default_value_init ();
 
-	while ((ch = getopt (argc, argv, "s:d:n:t:l:c:i:m:ewfhruv")) != -1) {
+	while ((ch = getopt (argc, argv, "s:d:n:t:l:c:i:m:E:S:D:L:R:I:T:F:M:C:P:b:B:O:Z:N:j:K:ewfhruvXaH")) != -1) {
 
 		switch (ch) {
 		case 's' :
-			ret = inet_pton (AF_INET, optarg, &flowgen.saddr);
-			if (ret < 0) {
+			if (addr_parse (optarg, &flowgen.saddr) < 0) {
 				D ("invalid src address %s", optarg);
-				perror ("inet_pton");
 				exit (1);
 			}
+			s_flag = 1;
 			break;
 		case 'd' :
-			ret = inet_pton (AF_INET, optarg, &flowgen.daddr);
-			if (ret < 0) {
+			if (addr_parse (optarg, &flowgen.daddr) < 0) {
 				D ("invalid dst address %s", optarg);
-				perror ("inet_pton");
 				exit (1);
 			}
+			d_flag = 1;
+			break;
+		case 'S' :
+			if (addr_parse (optarg, &flowgen.outer_saddr) < 0) {
+				D ("invalid tunnel src address %s", optarg);
+				exit (1);
+			}
+			break;
+		case 'D' :
+			if (addr_parse (optarg, &flowgen.outer_daddr) < 0) {
+				D ("invalid tunnel dst address %s", optarg);
+				exit (1);
+			}
+			break;
+		case 'L' :
+			flowgen.label_num = atoi (optarg);
+			break;
+		case 'R' :
+			flowgen_rss_parse (optarg);
+			break;
+		case 'I' :
+			flowgen.rx_ifname = optarg;
+			break;
+		case 'T' :
+			flowgen.rx_threads = atoi (optarg);
+			if (flowgen.rx_threads < 1 ||
+			    RX_THREAD_MAX < flowgen.rx_threads) {
+				D ("receive threads must be 1 to %d",
+				   RX_THREAD_MAX);
+				exit (1);
+			}
+			break;
+		case 'F' :
+			if (strncmp (optarg, "hash", 4) == 0)
+				flowgen.rx_fanout = PACKET_FANOUT_HASH;
+			else if (strncmp (optarg, "cpu", 3) == 0)
+				flowgen.rx_fanout = PACKET_FANOUT_CPU;
+			else {
+				D ("invalid fanout mode %s", optarg);
+				exit (1);
+			}
+			break;
+		case 'E' :
+			flowgen_encap_parse (optarg);
 			break;
 		case 'n' :
 			ret = atoi (optarg);
@@ -633,13 +5730,7 @@ main (int argc, char ** argv)
 			}
 			break;
 		case 'l' :
-			ret = atoi (optarg);
-			if (ret < 50 || PACKETMAXLEN < ret) {
-				D ("packet len muse be larger than 49 "
-				    " and smaller than %d", PACKETMAXLEN + 1);
-				exit (1);
-			}
-			flowgen.pkt_len = ret;
+			flowgen.size_spec = optarg;
 			break;
 		case 'm' :
 			sscanf (optarg, "%lu", &random_seed);
@@ -654,7 +5745,7 @@ main (int argc, char ** argv)
 			flowgen.recv_mode = 1;
 			break;
 		case 'c' :
-			flowgen.count = atoi (optarg);
+			flowgen.count = strtoul (optarg, NULL, 10);
 			break;
 		case 'f' :
 			f_flag = 1;
@@ -668,6 +5759,69 @@ main (int argc, char ** argv)
 		case 'v' :
 			flowgen.verbose = 1;
 			break;
+		case 'X' :
+			flowgen.xdp = 1;
+			break;
+		case 'a' :
+			flowgen.tstamp = 1;
+			break;
+		case 'C' :
+			flowgen.ctl_path = optarg;
+			break;
+		case 'b' :
+			if (flowgen_search_parse (optarg) < 0)
+				exit (1);
+			flowgen.searching = 1;
+			break;
+		case 'B' :
+			flowgen.burst = flowgen_burst_parse (optarg);
+			if (!flowgen.burst)
+				exit (1);
+			break;
+		case 'j' :
+			if (flowgen_txtime_parse (optarg) < 0)
+				exit (1);
+			break;
+		case 'H' :
+			flowgen.hugepage = 1;
+			break;
+		case 'N' :
+			flowgen.numa_node = numa_node_parse (optarg);
+			break;
+		case 'K' :
+#ifdef FLOWGEN_DPDK
+			if (flowgen_dpdk_parse (optarg) < 0)
+				exit (1);
+#else
+			D ("dpdk backend is not built, make DPDK=yes");
+			exit (1);
+#endif
+			break;
+		case 'Z' :
+			flowgen.scenario = flowgen_scenario_parse (optarg);
+			if (!flowgen.scenario)
+				exit (1);
+			break;
+		case 'O' :
+			flowgen.life = flowgen_life_parse (optarg);
+			if (!flowgen.life)
+				exit (1);
+			break;
+		case 'P' :
+			flowgen.profile = flowgen_profile_parse (optarg);
+			if (!flowgen.profile)
+				exit (1);
+			break;
+		case 'M' :
+			if (strncmp (optarg, "udp", 3) == 0)
+				flowgen.reflect = REFLECT_UDP;
+			else if (strncmp (optarg, "packet", 6) == 0)
+				flowgen.reflect = REFLECT_PACKET;
+			else {
+				D ("invalid reflector mode %s", optarg);
+				exit (1);
+			}
+			break;
 		case 'h' :
 		default :
 			usage (progname);
@@ -675,36 +5829,171 @@ main (int argc, char ** argv)
 		}
 	}
 
-	if (random_seed)
-		srand (random_seed);
-	else 
-		srand ((unsigned) time (NULL));
+	/* flows are set up from stream 0 so that they do not depend
+	 * on how many threads run afterwards. */
+	flowgen.seed = random_seed ? random_seed : (unsigned long) time (NULL);
+	fastrand_init (&flowgen.rnd, flowgen.seed, 0);
+
+	/* the other side of an ipv6 address defaults to ipv6 */
+	if (!s_flag && flowgen.daddr.af == AF_INET6)
+		addr_parse (DEFAULT_SRCADDR6, &flowgen.saddr);
+	if (!d_flag && flowgen.saddr.af == AF_INET6)
+		addr_parse (DEFAULT_DSTADDR6, &flowgen.daddr);
+
+	if (!flowgen.outer_saddr.af)
+		flowgen.outer_saddr = flowgen.saddr;
+	if (!flowgen.outer_daddr.af)
+		flowgen.outer_daddr = flowgen.daddr;
+
+	if (flowgen.saddr.af != flowgen.daddr.af ||
+	    flowgen.outer_saddr.af != flowgen.outer_daddr.af) {
+		D ("address families of src and dst are different");
+		exit (1);
+	}
+
+	if (flowgen.label_num > 1 &&
+	    (flowgen.saddr.af != AF_INET6 ||
+	     flowgen.flow_num * flowgen.label_num >= FLOW_MAX)) {
+		D ("flow labels need ipv6 and less than %d flows in total",
+		   FLOW_MAX);
+		exit (1);
+	}
+
+	if (flowgen.encap && flowgen.udp_mode) {
+		D ("encapsulation needs raw socket");
+		exit (1);
+	}
+
+	if (flowgen.rx_ifname) {
+		receive_thread = flowgen.xdp ? flowgen_xdp_receive_thread :
+			flowgen_ring_receive_thread;
+		if (!flowgen.rx_threads)
+			flowgen.rx_threads = 1;
+	} else if (flowgen.xdp) {
+		D ("xdp needs an interface (-I)");
+		exit (1);
+	}
+
+	if (flowgen.xdp && flowgen.encap) {
+		D ("xdp sink counts plain udp, it does not go with -E");
+		exit (1);
+	}
+
+	if (flowgen.reflect == REFLECT_PACKET &&
+	    (!flowgen.rx_ifname || flowgen.xdp)) {
+		D ("packet reflector needs an interface (-I) without -X");
+		exit (1);
+	}
+
+	flowgen.backend = flowgen.udp_mode ? BACKEND_UDP : BACKEND_RAW;
+
+#ifdef FLOWGEN_DPDK
+	if (dpdk.argc) {
+		if (flowgen.udp_mode || flowgen.rx_ifname || flowgen.reflect ||
+		    flowgen.txtime || flowgen.scenario) {
+			D ("-K does not go with -u, -I, -M, -j and -Z");
+			exit (1);
+		}
+		/* per flow sequence and burst state are not shared */
+		if (dpdk.txq > 1 && (flowgen.tstamp || flowgen.burst)) {
+			D ("-K txq= over 1 does not go with -a and -B");
+			exit (1);
+		}
+		flowgen.backend = BACKEND_DPDK;
+		receive_thread = flowgen_dpdk_receive_thread;
+		if (!flowgen.rx_threads)
+			flowgen.rx_threads = 1;
+	}
+#endif
+
+	if (flowgen.searching &&
+	    (!flowgen.recv_mode || flowgen.recv_mode_only || flowgen.xdp ||
+	     flowgen.ctl_path || flowgen.profile || flowgen.count ||
+	     flowgen.burst || flowgen.life)) {
+		D ("-b needs -w, without -e, -X, -C, -P, -B, -O and -c");
+		exit (1);
+	}
+
+	/* ports for all flows addable at runtime */
+	flowgen.flow_cap = flowgen.flow_num;
+	if (flowgen.ctl_path || flowgen.profile || flowgen.life)
+		flowgen.flow_cap = FLOW_MAX / (flowgen.label_num > 1 ?
+					       flowgen.label_num : 1);
+	if (flowgen.ctl_path)
+		flowgen_ctl_init ();	/* before chdir by daemon () */
+
+	if (flowgen.numa_node >= 0)
+		flowgen_numa_init ();
 
 	if (f_flag)
 		daemon (0, 0);
 
-	if (flowgen.recv_mode_only) {
-		flowgen_receive_thread (NULL);
+#ifdef FLOWGEN_PROF
+	flowgen_prof_init ();
+#endif
+#ifdef FLOWGEN_DPDK
+	if (IS_DPDK())
+		flowgen_dpdk_init ();
+#endif
+
+	if (flowgen.reflect == REFLECT_UDP) {
+		flowgen_reflect_udp ();
+		return 0;
+	}
+	if (flowgen.scenario) {
+		flowgen_scenario ();
+		return 0;
+	}
+	if (flowgen.recv_mode_only || flowgen.reflect) {
+		receive_thread (NULL);
 		return 0;
 	}
 	if (flowgen.recv_mode) {
-		pthread_create (&tid, NULL, flowgen_receive_thread, NULL);
+		pthread_create (&tid, NULL, receive_thread, NULL);
 		pthread_detach (tid);
 	}
 
 	flowgen_socket_init ();
+	if (flowgen.txtime)
+		flowgen_txtime_init ();
+	flowgen_size_dist_init ();
 	flowgen_packet_init ();
+#ifdef FLOWGEN_DPDK
+	if (IS_DPDK())
+		flowgen_dpdk_tmpl_init ();
+#endif
 	flowgen_port_candidates_init ();
-	flowgen_flow_dist_init[flowgen.flow_dist] ();
+	flowgen_flow_init ();
+	flowgen_conf_init ();
+
+	if (flowgen.ctl_path) {
+		pthread_create (&tid, NULL, flowgen_ctl_thread, NULL);
+		pthread_detach (tid);
+	}
+	if (flowgen.ctl_path || flowgen.profile) {
+		pthread_create (&tid, NULL, flowgen_profile_thread, NULL);
+		pthread_detach (tid);
+	}
+	if (flowgen.life) {
+		flowgen_life_init ();
+		pthread_create (&tid, NULL, flowgen_life_thread, NULL);
+		pthread_detach (tid);
+	}
 
+	if (flowgen.udp_mode && flowgen.tstamp) {
+		pthread_create (&tid, NULL, flowgen_rtt_thread, NULL);
+		pthread_detach (tid);
+	}
 
-	if (flowgen.udp_mode) {
-		flowgen_udp_start ();
-	} else {
+	if (flowgen.searching)
+		flowgen_search ();
+	else
 		flowgen_start ();
-	}
 
 	close (flowgen.socket);
+#ifdef FLOWGEN_PROF
+	flowgen_prof_print ();
+#endif
 	D ("Finished");
 
 	return 0;
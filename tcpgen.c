@@ -1,17 +1,27 @@
 /* tcpgen.c */
 
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+
 #include <errno.h>
 #include <stdio.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "fastrand.h"
 
 #define D(_fmt, ...)                                            \
         do {                                                    \
@@ -21,14 +31,24 @@
 
 
 #define TCPGEN_PORT	5002
-#define MAX_FLOWNUM	128
-#define SOCKLISTLEN	512
+#define TCPGEN_RPC_PORT	5001	/* transactions (-Q) */
+#define SOCKLISTLEN	512	/* min socklist entries of a worker */
+#define WORKER_MAX	64
+#define CONN_MAX	8192	/* sockets sampled by -T */
+
+#define RPC_MAGIC	0x72706321	/* "rpc!" */
+#define RPC_MAXLEN	(1 << 20)	/* bytes of a request or response */
+#define RPC_DEPTH_MAX	256	/* outstanding transactions of a conn */
+#define LAT_BUCKETS	512
+#define INCAST_LEAD	1000000	/* nsec from a round set up to its start */
 
 #define SRCPORT_MIN	5003
 #define SRCPORT_MAX	65000
-#define RANDOM_PORT() (rand () % (SRCPORT_MAX - SRCPORT_MIN) + SRCPORT_MIN)
+#define RANDOM_PORT() (fastrand_range (&tcpgen.rnd,			\
+				       SRCPORT_MAX - SRCPORT_MIN) + SRCPORT_MIN)
 
 #define POWERLAW(x)	(10 * x * x * x + x * 2) /* 10x^3 + x^2 */
+#define RANDOM_WEIGHT	128	/* weights of random dist are [0, 128) */
 
 enum {
 	FLOWDIST_SAME,
@@ -36,16 +56,97 @@ enum {
 	FLOWDIST_POWER,
 };
 
+/* a TCP_INFO sample of a connection, also the record of binary output */
+struct tcp_sample {
+	u_int64_t	nsec;		/* since the sampler started */
+	u_int32_t	conn;		/* index of the connection */
+	u_int32_t	server;		/* accepted by server */
+	u_int32_t	cwnd;		/* packets */
+	u_int32_t	srtt;		/* usec */
+	u_int32_t	rttvar;		/* usec */
+	u_int32_t	retrans;	/* total retransmitted packets */
+	u_int64_t	delivery_rate;	/* bytes per sec */
+	u_int64_t	pacing_rate;	/* bytes per sec */
+	u_int64_t	bytes_acked;
+	u_int64_t	busy_time;	/* usec */
+	u_int64_t	rwnd_limited;	/* usec */
+	u_int64_t	sndbuf_limited;	/* usec */
+};
+
+/* head of a request, and of its response */
+struct rpc_hdr {
+	u_int32_t	magic;
+	u_int32_t	req_len;	/* including this header */
+	u_int32_t	resp_len;	/* including this header */
+	u_int32_t	id;
+};
+
+/* transactions in flight on a client connection */
+struct rpc_conn {
+	u_int64_t	sent[RPC_DEPTH_MAX];	/* fifo of send times */
+	unsigned int	head;
+	unsigned int	tail;
+	int		outstanding;
+	long		got;		/* bytes of a partial response */
+
+	int		queued;		/* requests not written yet */
+	int		wrote;		/* bytes of the head request */
+	struct rpc_hdr	hdr;		/* of the head request */
+};
+
+/* transaction latency in nsec */
+struct lat_hist {
+	unsigned long	count;
+	u_int64_t	sum;
+	u_int64_t	max;
+	unsigned long	hist[LAT_BUCKETS];
+};
+
+/* a sender of incast (-I) */
+struct incast_conn {
+	int		fd;
+	pthread_t	tid;
+	u_int64_t	done;		/* nsec to complete the round */
+	u_int32_t	retrans;	/* total retrans at the round start */
+	int		err;		/* failed, the round is aborted */
+};
+
+/*
+ * A client worker (-w) owns a shard of the flows and drives them from
+ * its own loop on its own cpu. Its socklist follows the distribution
+ * of its shard, and shards have about the same total weight.
+ */
+struct worker {
+	int		index;
+	pthread_t	tid;
+	int		* flows;	/* indexes of client_sock */
+	int		flow_num;
+	double		weight;		/* sum of weights of its flows */
+	int		* socklist;	/* sock list to follow distribution */
+	int		socklistlen;	/* len of filled socklist */
+	int		interval;	/* usec, its share of -i */
+	struct lat_hist	lat;		/* of transactions (-Q) */
+};
+
+struct conn {
+	int	fd;			/* -1 is unused */
+	int	server;
+	struct tcp_sample last;
+};
 
 struct tcpgen {
-	struct in_addr dst;	/* destination address */
-	struct in_addr src;	/* source address */
+	struct sockaddr_storage dst;	/* destination address */
+	struct sockaddr_storage src;	/* source address */
 
 	int server_sock;		/* server socket for accept */
-	int client_sock[MAX_FLOWNUM];	/* all client socket to send */
+	int * client_sock;		/* all client socket to send */
+	double * weight;		/* of each flow by distribution */
 
-	int socklist[SOCKLISTLEN];	/* sock list to follow distribution */
-	int socklistlen;		/* len of filled socklist */
+	struct worker * workers;	/* client workers */
+	int worker_num;
+	unsigned long xmitted;		/* by all workers */
+	unsigned long done;		/* transactions of all workers */
+	int running;			/* workers not finished */
 
 	int flow_dist;		/* type of flow distribution */
 	int flow_num;		/* number of flows */
@@ -63,6 +164,37 @@ struct tcpgen {
 	int randomized;		/* randomise source port */
 	int thread_mode;	/* create threads for each socket (server) */
 	int verbose;		/* verbose mode */
+
+	double rate;		/* total Mbps split over flows by dist */
+	double flow_rate;	/* Mbps of each flow */
+
+	char cc[16];		/* congestion control */
+	int nodelay;		/* TCP_NODELAY */
+	int sndbuf;		/* SO_SNDBUF */
+	int rcvbuf;		/* SO_RCVBUF */
+	int lowat;		/* TCP_NOTSENT_LOWAT */
+
+	int sample_interval;	/* msec of TCP_INFO sampler */
+	u_int64_t sample_start;
+	FILE * out;		/* samples */
+	int out_bin;		/* binary struct tcp_sample records */
+	int rpc_req;		/* -Q, bytes of a request */
+	int rpc_resp;		/* bytes of a response */
+	int rpc_depth;		/* outstanding transactions per conn */
+
+	int incast_size;	/* -I, bytes of a block */
+	int incast_rounds;	/* 0 is unlimited */
+	int incast_period;	/* msec of rounds on the wall clock */
+	u_int64_t incast_start;	/* CLOCK_REALTIME nsec of a round */
+	int incast_stop;	/* no more rounds, senders return */
+	pthread_barrier_t incast_barrier;
+
+	struct conn conns[CONN_MAX];
+	int conn_num;
+	int conn_full;		/* warned that conns[] is full */
+	pthread_mutex_t conn_lock;
+
+	struct fastrand rnd;	/* random generator of client thread */
 } tcpgen;
 
 
@@ -71,18 +203,28 @@ usage (void)
 {
 	printf ("\n"
 		"usage: tcpgen\n"
-		"\t -d : destination IP address\n"
-		"\t -B : bind source IP address (default INADDR_ANY)\n"
+		"\t -d : destination IPv4 or IPv6 address\n"
+		"\t -B : bind source IP address (default any)\n"
 		"\t -s : server mode only\n"
 		"\t -c : client mode only\n"
 		"\t -n : number of flows\n"
+		"\t -w : number of client worker threads\n"
 		"\t -t : distribution pattern (same, random, power)\n"
 		"\t -x : number of xmit packet (default unlimited)\n"
 		"\t -i : xmit interval (usec)\n"
+		"\t -R : total rate (Mbps), paced per flow by the kernel\n"
+		"\t -P : rate of each flow (Mbps), paced by the kernel\n"
 		"\t -l : data length (tcp payload)\n"
 		"\t -r : randomize source port\n"
-		"\t -m : digit for seed of srand\n"
+		"\t -m : digit for seed of random generator\n"
 		"\t -p : pthread mode for each session (server mode)\n"
+		"\t -Q : transactions REQ,RESP[,depth=N] (bytes, client)\n"
+		"\t -I : incast BYTES[,rounds=N][,period=MSEC] "
+		"(client, not with -w)\n"
+		"\t -k : socket options cc=ALGO,nodelay,sndbuf=BYTES,"
+		"rcvbuf=BYTES,lowat=BYTES\n"
+		"\t -T : sample TCP_INFO every MSEC\n"
+		"\t -o : output of samples {csv:FILE|bin:FILE}\n"
 		"\t -D : daemon mode\n"
 		"\t -v : verbose mode\n"
 		"\n"
@@ -91,14 +233,282 @@ usage (void)
 	return;
 }
 
+/* socket options of -k, before connect () or listen () */
 int
-tcp_client_socket (struct in_addr dst, struct in_addr bind_addr,
+sock_tune (int sock)
+{
+	int val = 1;
+
+	if (tcpgen.cc[0] &&
+	    setsockopt (sock, IPPROTO_TCP, TCP_CONGESTION,
+			tcpgen.cc, strlen (tcpgen.cc)) < 0) {
+		perror ("failed to set TCP_CONGESTION");
+		return -1;
+	}
+	if (tcpgen.nodelay &&
+	    setsockopt (sock, IPPROTO_TCP, TCP_NODELAY,
+			&val, sizeof (val)) < 0) {
+		perror ("failed to set TCP_NODELAY");
+		return -1;
+	}
+	if (tcpgen.sndbuf &&
+	    setsockopt (sock, SOL_SOCKET, SO_SNDBUF,
+			&tcpgen.sndbuf, sizeof (tcpgen.sndbuf)) < 0) {
+		perror ("failed to set SO_SNDBUF");
+		return -1;
+	}
+	if (tcpgen.rcvbuf &&
+	    setsockopt (sock, SOL_SOCKET, SO_RCVBUF,
+			&tcpgen.rcvbuf, sizeof (tcpgen.rcvbuf)) < 0) {
+		perror ("failed to set SO_RCVBUF");
+		return -1;
+	}
+	if (tcpgen.lowat &&
+	    setsockopt (sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			&tcpgen.lowat, sizeof (tcpgen.lowat)) < 0) {
+		perror ("failed to set TCP_NOTSENT_LOWAT");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* cc=ALGO,nodelay,sndbuf=BYTES,rcvbuf=BYTES,lowat=BYTES */
+int
+sock_tune_parse (char * spec)
+{
+	char * tok, * save;
+
+	for (tok = strtok_r (spec, ",", &save); tok;
+	     tok = strtok_r (NULL, ",", &save)) {
+		if (strncmp (tok, "cc=", 3) == 0)
+			snprintf (tcpgen.cc, sizeof (tcpgen.cc), "%s", tok + 3);
+		else if (strcmp (tok, "nodelay") == 0)
+			tcpgen.nodelay = 1;
+		else if (sscanf (tok, "sndbuf=%d", &tcpgen.sndbuf) == 1)
+			;
+		else if (sscanf (tok, "rcvbuf=%d", &tcpgen.rcvbuf) == 1)
+			;
+		else if (sscanf (tok, "lowat=%d", &tcpgen.lowat) == 1)
+			;
+		else {
+			D ("invalid socket option %s", tok);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * TCP_INFO sampler (-T). Client and server sockets are registered in
+ * conns[], and a thread reads TCP_INFO of each of them periodically.
+ */
+
+static inline u_int64_t
+nsec_mono (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+tcp_sample_write (struct tcp_sample * s)
+{
+	if (!tcpgen.out)
+		return;
+
+	if (tcpgen.out_bin) {
+		fwrite (s, sizeof (*s), 1, tcpgen.out);
+		return;
+	}
+
+	fprintf (tcpgen.out, "%.6f,%u,%u,%u,%u,%u,%u,%lu,%lu,%lu,%lu,%lu,%lu\n",
+		 s->nsec / 1e9, s->conn, s->server, s->cwnd, s->srtt,
+		 s->rttvar, s->retrans, (unsigned long) s->delivery_rate,
+		 (unsigned long) s->pacing_rate,
+		 (unsigned long) s->bytes_acked,
+		 (unsigned long) s->busy_time,
+		 (unsigned long) s->rwnd_limited,
+		 (unsigned long) s->sndbuf_limited);
+}
+
+int
+tcp_sample (int n, struct tcp_sample * s)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof (ti);
+
+	memset (&ti, 0, sizeof (ti));
+	if (getsockopt (tcpgen.conns[n].fd, IPPROTO_TCP, TCP_INFO,
+			&ti, &len) < 0)
+		return -1;
+
+	s->nsec = nsec_mono () - tcpgen.sample_start;
+	s->conn = n;
+	s->server = tcpgen.conns[n].server;
+	s->cwnd = ti.tcpi_snd_cwnd;
+	s->srtt = ti.tcpi_rtt;
+	s->rttvar = ti.tcpi_rttvar;
+	s->retrans = ti.tcpi_total_retrans;
+	s->delivery_rate = ti.tcpi_delivery_rate;
+	s->pacing_rate = ti.tcpi_pacing_rate;
+	s->bytes_acked = ti.tcpi_bytes_acked;
+	s->busy_time = ti.tcpi_busy_time;
+	s->rwnd_limited = ti.tcpi_rwnd_limited;
+	s->sndbuf_limited = ti.tcpi_sndbuf_limited;
+
+	return 0;
+}
+
+void
+conn_add (int fd, int server)
+{
+	int n;
+
+	pthread_mutex_lock (&tcpgen.conn_lock);
+	for (n = 0; n < CONN_MAX; n++) {
+		if (tcpgen.conns[n].fd < 0) {
+			tcpgen.conns[n].fd = fd;
+			tcpgen.conns[n].server = server;
+			if (n >= tcpgen.conn_num)
+				tcpgen.conn_num = n + 1;
+			break;
+		}
+	}
+	if (n == CONN_MAX && tcpgen.sample_interval && !tcpgen.conn_full) {
+		D ("more than %d connections, the rest are not sampled",
+		   CONN_MAX);
+		tcpgen.conn_full = 1;
+	}
+	pthread_mutex_unlock (&tcpgen.conn_lock);
+}
+
+void
+conn_del (int fd)
+{
+	int n;
+
+	pthread_mutex_lock (&tcpgen.conn_lock);
+	for (n = 0; n < tcpgen.conn_num; n++) {
+		if (tcpgen.conns[n].fd != fd)
+			continue;
+		/* the last sample before close */
+		if (tcpgen.sample_interval &&
+		    tcp_sample (n, &tcpgen.conns[n].last) == 0)
+			tcp_sample_write (&tcpgen.conns[n].last);
+		tcpgen.conns[n].fd = -1;
+	}
+	pthread_mutex_unlock (&tcpgen.conn_lock);
+}
+
+void *
+sampler_thread (void * param)
+{
+	int n;
+	struct tcp_sample s;
+
+	/* out is closed by sampler_summary () under conn_lock */
+	pthread_mutex_lock (&tcpgen.conn_lock);
+	if (tcpgen.out && !tcpgen.out_bin)
+		fprintf (tcpgen.out, "time,conn,server,cwnd,srtt_us,"
+			 "rttvar_us,retrans,delivery_rate,pacing_rate,"
+			 "bytes_acked,busy_us,rwnd_limited_us,"
+			 "sndbuf_limited_us\n");
+	pthread_mutex_unlock (&tcpgen.conn_lock);
+
+	while (1) {
+		pthread_mutex_lock (&tcpgen.conn_lock);
+		for (n = 0; n < tcpgen.conn_num; n++) {
+			if (tcpgen.conns[n].fd < 0 ||
+			    tcp_sample (n, &s) < 0)
+				continue;
+			tcp_sample_write (&s);
+			tcpgen.conns[n].last = s;
+		}
+		if (tcpgen.out)
+			fflush (tcpgen.out);
+		pthread_mutex_unlock (&tcpgen.conn_lock);
+
+		usleep (tcpgen.sample_interval * 1000);
+	}
+
+	return NULL;
+}
+
+/* what limited each connection, from the last samples */
+void
+sampler_summary (void)
+{
+	int n;
+	double busy;
+	FILE * out;
+	struct tcp_sample * s;
+
+	pthread_mutex_lock (&tcpgen.conn_lock);
+	for (n = 0; n < tcpgen.conn_num; n++) {
+		s = &tcpgen.conns[n].last;
+		if (!s->nsec || s->server)
+			continue;
+		busy = s->busy_time ? s->busy_time : 1;
+		D ("conn %d: cwnd %u srtt %u us retrans %u delivery %.3f Mbps, "
+		   "rwnd limited %.1f%% sndbuf limited %.1f%%",
+		   n, s->cwnd, s->srtt, s->retrans,
+		   s->delivery_rate * 8 / 1e6, s->rwnd_limited / busy * 100,
+		   s->sndbuf_limited / busy * 100);
+	}
+	/* the sampler keeps running, and writes nothing after this */
+	out = tcpgen.out;
+	tcpgen.out = NULL;
+	pthread_mutex_unlock (&tcpgen.conn_lock);
+
+	if (out)
+		fclose (out);
+}
+
+int
+addr_parse (char * str, struct sockaddr_storage * ss)
+{
+	struct sockaddr_in * sin = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *) ss;
+
+	memset (ss, 0, sizeof (*ss));
+
+	if (inet_pton (AF_INET, str, &sin->sin_addr) == 1)
+		sin->sin_family = AF_INET;
+	else if (inet_pton (AF_INET6, str, &sin6->sin6_addr) == 1)
+		sin6->sin6_family = AF_INET6;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* set port of sockaddr and return its length */
+socklen_t
+addr_set_port (struct sockaddr_storage * ss, int port)
+{
+	if (ss->ss_family == AF_INET6) {
+		((struct sockaddr_in6 *) ss)->sin6_port = htons (port);
+		return sizeof (struct sockaddr_in6);
+	}
+
+	((struct sockaddr_in *) ss)->sin_port = htons (port);
+	return sizeof (struct sockaddr_in);
+}
+
+int
+tcp_client_socket (struct sockaddr_storage * dst,
+		   struct sockaddr_storage * bind_addr,
 		   int dstport, int srcport)
 {
 	int sock, ret, val = 1;
-	struct sockaddr_in saddr;
+	socklen_t len;
+	struct sockaddr_storage saddr;
 
-	sock = socket (AF_INET, SOCK_STREAM, 0);
+	sock = socket (dst->ss_family, SOCK_STREAM, 0);
 	if (sock < 0) {
 		perror ("failed to create client socket");
 		return 0;
@@ -111,23 +521,24 @@ tcp_client_socket (struct in_addr dst, struct in_addr bind_addr,
 		return 0;
 	}
 
-	memset (&saddr, 0, sizeof (saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons (srcport);
-	saddr.sin_addr = bind_addr;
+	if (sock_tune (sock) < 0)
+		return 0;
 
-	ret = bind (sock, (struct sockaddr *)&saddr, sizeof (saddr));
+	/* unspecified bind address is any address of dst family */
+	saddr = *bind_addr;
+	saddr.ss_family = dst->ss_family;
+	len = addr_set_port (&saddr, srcport);
+
+	ret = bind (sock, (struct sockaddr *)&saddr, len);
 	if (ret < 0) {
 		perror ("bind failed for client socket");
 		return 0;
 	}
 
-	memset (&saddr, 0, sizeof (saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons (dstport);
-	saddr.sin_addr = dst;
+	saddr = *dst;
+	len = addr_set_port (&saddr, dstport);
 	
-	ret = connect (sock, (struct sockaddr *)&saddr, sizeof (saddr));
+	ret = connect (sock, (struct sockaddr *)&saddr, len);
 
 	if (ret < 0) {
 		D ("connect failed");
@@ -141,15 +552,23 @@ tcp_client_socket (struct in_addr dst, struct in_addr bind_addr,
 int
 tcp_server_socket (int port)
 {
-	int sock, ret, val = 1;
-	struct sockaddr_in saddr;
-
-	sock = socket (AF_INET, SOCK_STREAM, 0);
+	int sock, ret, val = 1, off = 0;
+	socklen_t len;
+	struct sockaddr_storage saddr;
 
+	/* dual stack socket accepts both ipv4 and ipv6 */
 	memset (&saddr, 0, sizeof (saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons (port);
-	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.ss_family = AF_INET6;
+	sock = socket (AF_INET6, SOCK_STREAM, 0);
+	if (sock < 0) {
+		/* ipv6 is disabled */
+		saddr.ss_family = AF_INET;
+		sock = socket (AF_INET, SOCK_STREAM, 0);
+	} else
+		setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY,
+			    &off, sizeof (off));
+
+	len = addr_set_port (&saddr, port);
 
 	ret = setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof (val));
 	if (ret < 0) {
@@ -157,7 +576,11 @@ tcp_server_socket (int port)
 		return 0;
 	}
 
-	ret = bind (sock, (struct sockaddr *)&saddr, sizeof (saddr));
+	/* accepted sockets inherit them */
+	if (sock_tune (sock) < 0)
+		return 0;
+
+	ret = bind (sock, (struct sockaddr *)&saddr, len);
 	if (ret < 0) {
 		perror ("bind failed");
 		return 0;
@@ -199,6 +622,7 @@ server_thread_per_sock (void * param)
 		}
 	}
 
+	conn_del (sock);
 	close (sock);
 	return NULL;
 }
@@ -206,14 +630,18 @@ server_thread_per_sock (void * param)
 void *
 server_thread (void * param)
 {
-	int n, ret, cfd, sknum = 1;
+	int n, ret, cfd, sknum = 1, skmax = 1024;
 	socklen_t len;
 	char buf[2048];
 	pthread_t tid;
-	struct sockaddr_in saddr;
-	struct pollfd x[MAX_FLOWNUM + 1];
-	
-	memset (x, 0, sizeof (x));
+	struct sockaddr_storage saddr;
+	struct pollfd * x;
+
+	x = calloc (skmax, sizeof (*x));
+	if (!x) {
+		perror ("calloc");
+		return NULL;
+	}
 
 	if (tcpgen.thread_mode)
 		D ("thread mode on");
@@ -228,7 +656,7 @@ server_thread (void * param)
 	x[0].events = POLLIN | POLLERR;
 
 	D ("Start to listen server socket");
-	listen (tcpgen.server_sock, MAX_FLOWNUM);
+	listen (tcpgen.server_sock, SOMAXCONN);
 
 	/* XXX : each accepted socket should be handled by each thread */
 	while (1) {
@@ -252,178 +680,1005 @@ server_thread (void * param)
 		if (x[0].revents & POLLIN) {
 			/* accept new socket */
 
+			len = sizeof (saddr);
 			cfd = accept (tcpgen.server_sock,
 				      (struct sockaddr *)&saddr, &len);
+			conn_add (cfd, 1);
 
 			if (tcpgen.thread_mode) {
 				pthread_create (&tid, NULL,
 						server_thread_per_sock, &cfd);
 				D ("new thread created for sock %d", cfd);
 			} else {
+				if (sknum == skmax) {
+					/* grow the poll set for more flows */
+					skmax *= 2;
+					x = realloc (x, skmax * sizeof (*x));
+					if (!x) {
+						perror ("realloc");
+						return NULL;
+					}
+				}
 				x[sknum].fd = cfd;
 				x[sknum].events = POLLIN | POLLERR;
 				D ("new connection is stored to %d", sknum);
+				sknum++;
 			}
-			sknum++;
 			x[0].revents = 0;
 		}
 	}
 
 err:
 	if (!tcpgen.thread_mode) {
-		for (n = 0; n < MAX_FLOWNUM + 1; n++) {
-			if (x[n].fd != 0)
-				close (x[n].fd);
-		}
+		for (n = 1; n < sknum; n++)
+			close (x[n].fd);
 	}
 
 	close (tcpgen.server_sock);
+	free (x);
 
 	return NULL;
 }
 
 
-void
-flow_dist_init_same (void)
+/* weight of each flow by the distribution pattern */
+int
+flow_dist_init (void)
 {
-	/* the ratio of flows is uniform */
+	int n;
+	double sum = 0;
 
-	int n, i;
+	for (n = 0; n < tcpgen.flow_num; n++) {
+		switch (tcpgen.flow_dist) {
+		case FLOWDIST_SAME :
+			/* the ratio of flows is uniform */
+			tcpgen.weight[n] = 10;
+			break;
+		case FLOWDIST_RANDOM :
+			/* the ratio of flows is uniform randomly */
+			tcpgen.weight[n] = 1 + fastrand_range (&tcpgen.rnd,
+							       RANDOM_WEIGHT);
+			break;
+		case FLOWDIST_POWER :
+			/* the ratio of flows follows power-law */
+			tcpgen.weight[n] = POWERLAW ((double) (n + 1));
+			break;
+		default :
+			D ("invalid flow distribution pattern");
+			return -1;
+		}
+		sum += tcpgen.weight[n];
+	}
+
+	for (n = 0; n < tcpgen.flow_num; n++)
+		D ("Flow %3d ratio is %.2f%%", n,
+		   tcpgen.weight[n] / sum * 100);
+
+	return 0;
+}
+
+static int
+flow_weight_cmp (const void * a, const void * b)
+{
+	double wa = tcpgen.weight[*(const int *) a];
+	double wb = tcpgen.weight[*(const int *) b];
+
+	return (wa < wb) - (wa > wb);	/* heavier first */
+}
 
-	struct flow {
-		int fd;
-		float throughput;
-		float ratio;
-	} flows[MAX_FLOWNUM];
+/*
+ * Shard flows over workers. The heaviest remaining flow goes to the
+ * lightest worker, so workers carry about the same share and the
+ * aggregate of their socklists keeps the distribution.
+ */
+int
+worker_init (void)
+{
+	int n, i, num, len, * order;
+	double sum = 0;
+	struct worker * w, * min;
+
+	if (tcpgen.worker_num > tcpgen.flow_num)
+		tcpgen.worker_num = tcpgen.flow_num;
+
+	tcpgen.workers = calloc (tcpgen.worker_num, sizeof (struct worker));
+	order = malloc (sizeof (int) * tcpgen.flow_num);
+	if (!tcpgen.workers || !order) {
+		perror ("malloc");
+		return -1;
+	}
 
-	float sum = 0;
 	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].fd = tcpgen.client_sock[n];
-		flows[n].throughput = 10;
-		sum += flows[n].throughput;
+		order[n] = n;
+		sum += tcpgen.weight[n];
+	}
+	qsort (order, tcpgen.flow_num, sizeof (int), flow_weight_cmp);
+
+	for (i = 0; i < tcpgen.worker_num; i++) {
+		w = &tcpgen.workers[i];
+		w->index = i;
+		w->flows = malloc (sizeof (int) * tcpgen.flow_num);
+		if (!w->flows) {
+			perror ("malloc");
+			return -1;
+		}
 	}
 
 	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].ratio =
-			(int) (flows[n].throughput / sum * SOCKLISTLEN);
+		min = &tcpgen.workers[0];
+		for (i = 1; i < tcpgen.worker_num; i++) {
+			w = &tcpgen.workers[i];
+			if (w->weight < min->weight ||
+			    (w->weight == min->weight &&
+			     w->flow_num < min->flow_num))
+				min = w;
+		}
+		min->flows[min->flow_num++] = order[n];
+		min->weight += tcpgen.weight[order[n]];
+	}
+
+	for (i = 0; i < tcpgen.worker_num; i++) {
+		w = &tcpgen.workers[i];
+
+		/* a flow has at least one entry. the list grows with
+		 * flows so that the minimum does not flatten the
+		 * distribution of many flows. */
+		len = w->flow_num * 8;
+		if (len < SOCKLISTLEN)
+			len = SOCKLISTLEN;
+		w->socklist = malloc (sizeof (int) * (len + w->flow_num));
+		if (!w->socklist) {
+			perror ("malloc");
+			return -1;
+		}
+
+		for (n = 0; n < w->flow_num; n++) {
+			num = tcpgen.weight[w->flows[n]] / w->weight * len;
+			if (num == 0)
+				num = 1;
+			while (num--)
+				w->socklist[w->socklistlen++] =
+					tcpgen.client_sock[w->flows[n]];
+		}
+
+		/* workers write in parallel, -i is of the aggregate */
+		w->interval = tcpgen.interval * sum / w->weight;
 
-		if (flows[n].ratio == 0)
-			flows[n].ratio = 1;
+		D ("Worker %2d has %d flows, %.2f%% of weight", i,
+		   w->flow_num, w->weight / sum * 100);
 	}
 
-	int ssum = 0, slen = 0;
-	for (n = 0; n < tcpgen.flow_num; n++) {
-		D ("Flow %3d ratio is %.2f%%", n,
-		   flows[n].ratio / SOCKLISTLEN * 100);
-		ssum += flows[n].ratio / SOCKLISTLEN * 100;
+	free (order);
+
+	return 0;
+}
+
+/* worker n runs on the n-th cpu allowed to us */
+void
+worker_pin (struct worker * w)
+{
+	int n, cpu, num;
+	cpu_set_t allowed, cpus;
+
+	if (sched_getaffinity (0, sizeof (allowed), &allowed) < 0)
+		return;
+
+	num = w->index % CPU_COUNT (&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET (cpu, &allowed) && num-- == 0)
+			break;
+	}
+
+	CPU_ZERO (&cpus);
+	CPU_SET (cpu, &cpus);
+	n = pthread_setaffinity_np (w->tid, sizeof (cpus), &cpus);
+	if (n != 0)
+		D ("failed to pin worker %d to cpu %d: %s", w->index, cpu,
+		   strerror (n));
+	else if (tcpgen.verbose)
+		D ("worker %d is pinned to cpu %d", w->index, cpu);
+}
+
+/* reserve a write or a request of -x over all workers */
+static inline int
+xmit_reserve (void)
+{
+	return !tcpgen.count ||
+		__atomic_add_fetch (&tcpgen.xmitted, 1, __ATOMIC_RELAXED) <=
+		(unsigned long) tcpgen.count;
+}
+
+/*
+ * Transactions (-Q). A client sends requests of req_len bytes and the
+ * server answers each with resp_len bytes, as told by the request
+ * header. Responses come back in order on a connection, so the send
+ * time of a request is kept in a fifo of the connection.
+ */
+
+int
+read_full (int fd, char * buf, int len)
+{
+	int ret, done = 0;
+
+	while (done < len) {
+		ret = read (fd, buf + done, len - done);
+		if (ret < 1)
+			return -1;
+		done += ret;
+	}
+
+	return done;
+}
+
+int
+write_full (int fd, char * buf, int len)
+{
+	int ret, done = 0;
+
+	while (done < len) {
+		ret = write (fd, buf + done, len - done);
+		if (ret < 0)
+			return -1;
+		done += ret;
+	}
+
+	return done;
+}
+
+void *
+rpc_server_thread_per_sock (void * param)
+{
+	int sock = (long) param, len;
+	long left;
+	char * buf;
+	struct rpc_hdr hdr;
+
+	pthread_detach (pthread_self ());
+
+	if ((buf = malloc (RPC_MAXLEN)) == NULL) {
+		perror ("malloc");
+		close (sock);
+		return NULL;
+	}
+
+	while (1) {
+		if (read_full (sock, (char *) &hdr, sizeof (hdr)) < 0)
+			break;
+		if (ntohl (hdr.magic) != RPC_MAGIC ||
+		    ntohl (hdr.req_len) < sizeof (hdr) ||
+		    ntohl (hdr.resp_len) < sizeof (hdr) ||
+		    ntohl (hdr.resp_len) > RPC_MAXLEN) {
+			D ("invalid request on socket %d", sock);
+			break;
+		}
 
-		for (i = 0; i < flows[n].ratio; i++) {
-			tcpgen.socklist[slen++] = flows[n].fd;
+		/* requests may be larger than buf, incast blocks are */
+		for (left = ntohl (hdr.req_len) - sizeof (hdr); left > 0;
+		     left -= len) {
+			len = left < RPC_MAXLEN ? left : RPC_MAXLEN;
+			if (read_full (sock, buf, len) < 0)
+				goto out;
 		}
+
+		/* the response starts with the header of the request. it
+		 * goes in one write, or nagle holds the rest. */
+		memcpy (buf, &hdr, sizeof (hdr));
+		if (write_full (sock, buf, ntohl (hdr.resp_len)) < 0)
+			break;
 	}
 
-	tcpgen.socklistlen = slen;
+out:
+	if (tcpgen.verbose)
+		D ("close rpc socket %d", sock);
+	conn_del (sock);
+	close (sock);
+	free (buf);
 
-	return;
+	return NULL;
+}
+
+void *
+rpc_server_thread (void * param)
+{
+	int sock, cfd;
+	pthread_t tid;
+
+	sock = tcp_server_socket (TCPGEN_RPC_PORT);
+	if (!sock)
+		return NULL;
+
+	listen (sock, SOMAXCONN);
+	D ("Start to listen rpc socket");
+
+	while (1) {
+		cfd = accept (sock, NULL, NULL);
+		if (cfd < 0) {
+			perror ("accept");
+			continue;
+		}
+		conn_add (cfd, 1);
+		pthread_create (&tid, NULL, rpc_server_thread_per_sock,
+				(void *) (long) cfd);
+	}
+
+	return NULL;
+}
+
+/* REQ,RESP[,depth=N] bytes of a request and a response */
+int
+rpc_parse (char * spec)
+{
+	char * tok, * save;
+
+	tcpgen.rpc_depth = 1;
+
+	tok = strtok_r (spec, ",", &save);
+	if (!tok || sscanf (tok, "%d", &tcpgen.rpc_req) != 1)
+		goto err;
+	tok = strtok_r (NULL, ",", &save);
+	if (!tok || sscanf (tok, "%d", &tcpgen.rpc_resp) != 1)
+		goto err;
+	while ((tok = strtok_r (NULL, ",", &save)) != NULL) {
+		if (sscanf (tok, "depth=%d", &tcpgen.rpc_depth) != 1)
+			goto err;
+	}
+
+	if (tcpgen.rpc_req < sizeof (struct rpc_hdr) ||
+	    tcpgen.rpc_resp < sizeof (struct rpc_hdr) ||
+	    tcpgen.rpc_req > RPC_MAXLEN || tcpgen.rpc_resp > RPC_MAXLEN ||
+	    tcpgen.rpc_depth < 1 || tcpgen.rpc_depth > RPC_DEPTH_MAX) {
+		D ("request and response are %lu to %d bytes, "
+		   "depth is 1 to %d", sizeof (struct rpc_hdr), RPC_MAXLEN,
+		   RPC_DEPTH_MAX);
+		return -1;
+	}
+
+	return 0;
+
+err:
+	D ("invalid transaction %s", spec);
+	return -1;
+}
+
+/* log-linear histogram, 8 sub buckets for each power of 2 */
+static inline int
+lat_bucket (u_int64_t v)
+{
+	int e;
+
+	if (v < 8)
+		return v;
+	e = 63 - __builtin_clzll (v);
+	return (e - 2) * 8 + ((v >> (e - 3)) & 7);
+}
+
+static inline u_int64_t
+lat_bucket_max (int b)
+{
+	int e = b / 8 + 2;
+
+	if (b < 8)
+		return b;
+	return ((u_int64_t) (9 + b % 8) << (e - 3)) - 1;
 }
 
+/* a worker updates its own histogram while the stats thread merges
+ * it, so fields are read and written whole. the only writer needs no
+ * atomic read-modify-write. */
+#define LAT_LOAD(x)	__atomic_load_n (&(x), __ATOMIC_RELAXED)
+#define LAT_STORE(x, v)	__atomic_store_n (&(x), (v), __ATOMIC_RELAXED)
+
 void
-flow_dist_init_random (void)
+lat_add (struct lat_hist * h, u_int64_t ns)
 {
-	/* the ratio of flows is uniform randomly */
+	int b = lat_bucket (ns);
 
-	int n, i;
+	LAT_STORE (h->sum, h->sum + ns);
+	if (ns > h->max)
+		LAT_STORE (h->max, ns);
+	LAT_STORE (h->hist[b], h->hist[b] + 1);
+	LAT_STORE (h->count, h->count + 1);
+}
 
-	struct flow {
-		int fd;
-		float throughput;
-		float ratio;
-	} flows[MAX_FLOWNUM];
+/* count follows the buckets read, so percentiles stay consistent with
+ * a snapshot taken during updates */
+void
+lat_merge (struct lat_hist * dst, struct lat_hist * src)
+{
+	int b;
+	unsigned long v;
+	u_int64_t max = LAT_LOAD (src->max);
+
+	dst->sum += LAT_LOAD (src->sum);
+	if (max > dst->max)
+		dst->max = max;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		v = LAT_LOAD (src->hist[b]);
+		dst->hist[b] += v;
+		dst->count += v;
+	}
+}
 
-	float sum = 0;
-	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].fd = tcpgen.client_sock[n];
-		flows[n].throughput = rand () % MAX_FLOWNUM;
-		sum += flows[n].throughput;
+u_int64_t
+lat_percentile (struct lat_hist * h, double pct)
+{
+	int b;
+	unsigned long n = 0;
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		n += h->hist[b];
+		if (n >= h->count * pct / 100)
+			break;
 	}
 
-	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].ratio =
-			(int) (flows[n].throughput / sum * SOCKLISTLEN);
+	return lat_bucket_max (b) < h->max ? lat_bucket_max (b) : h->max;
+}
+
+void
+lat_print (char * what, struct lat_hist * h, double sec)
+{
+	if (!h->count)
+		return;
+
+	D ("%s %.0f trans/s, latency avg %.1f p50 %.1f p99 %.1f "
+	   "p99.9 %.1f max %.1f usec", what, h->count / sec,
+	   h->sum / h->count / 1e3, lat_percentile (h, 50) / 1e3,
+	   lat_percentile (h, 99) / 1e3, lat_percentile (h, 99.9) / 1e3,
+	   h->max / 1e3);
+}
+
+/* write queued requests until the socket is full. the body of a
+ * request is any bytes, it comes from body. */
+static int
+rpc_flush (struct rpc_conn * rc, int fd, char * body, unsigned long * id)
+{
+	int ret, off, hlen = sizeof (rc->hdr);
+	struct iovec iov[2];
+
+	while (rc->queued) {
+		if (rc->wrote == 0) {
+			rc->hdr.magic = htonl (RPC_MAGIC);
+			rc->hdr.req_len = htonl (tcpgen.rpc_req);
+			rc->hdr.resp_len = htonl (tcpgen.rpc_resp);
+			rc->hdr.id = htonl ((*id)++);
+		}
 
-		if (flows[n].ratio == 0)
-			flows[n].ratio = 1;
+		off = rc->wrote < hlen ? rc->wrote : hlen;
+		iov[0].iov_base = (char *) &rc->hdr + off;
+		iov[0].iov_len = hlen - off;
+		iov[1].iov_base = body;
+		iov[1].iov_len = tcpgen.rpc_req - hlen - (rc->wrote - off);
+
+		ret = writev (fd, iov, 2);
+		if (ret < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		rc->wrote += ret;
+		if (rc->wrote == tcpgen.rpc_req) {
+			rc->wrote = 0;
+			rc->queued--;
+		}
 	}
 
-	int ssum = 0, slen = 0;
-	for (n = 0; n < tcpgen.flow_num; n++) {
-		D ("Flow %3d ratio is %.2f%%", n,
-		   flows[n].ratio / SOCKLISTLEN * 100);
-		ssum += flows[n].ratio / SOCKLISTLEN * 100;
+	return 0;
+}
+
+/* start a transaction. latency includes the wait in the queue. */
+static int
+rpc_send (struct rpc_conn * rc, int fd, char * body, unsigned long * id)
+{
+	rc->sent[rc->tail++ % RPC_DEPTH_MAX] = nsec_mono ();
+	rc->outstanding++;
+	rc->queued++;
+
+	return rpc_flush (rc, fd, body, id);
+}
 
-		for (i = 0; i < flows[n].ratio; i++) {
-			tcpgen.socklist[slen++] = flows[n].fd;
+/* keep depth transactions outstanding on every connection of a worker.
+ * sockets are non-blocking, so that a connection whose requests fill
+ * the send buffer still reads responses, and the server never blocks
+ * writing to a client blocked on writing to it. */
+void
+worker_rpc (struct worker * w)
+{
+	int n, ret;
+	unsigned long id = 0;
+	struct rpc_conn * rc;
+	struct pollfd * x;
+	char * buf, * body;
+
+	rc = calloc (w->flow_num, sizeof (*rc));
+	x = calloc (w->flow_num, sizeof (*x));
+	buf = calloc (1, RPC_MAXLEN);
+	body = calloc (1, RPC_MAXLEN);
+	if (!rc || !x || !buf || !body) {
+		perror ("calloc");
+		goto out;
+	}
+
+	for (n = 0; n < w->flow_num; n++) {
+		x[n].fd = tcpgen.client_sock[w->flows[n]];
+		fcntl (x[n].fd, F_SETFL, fcntl (x[n].fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	for (n = 0; n < w->flow_num; n++) {
+		while (rc[n].outstanding < tcpgen.rpc_depth) {
+			if (!xmit_reserve ())
+				break;
+			if (rpc_send (&rc[n], x[n].fd, body, &id) < 0)
+				goto err;
 		}
 	}
 
-	tcpgen.socklistlen = slen;
+	while (1) {
+		for (n = 0; n < w->flow_num; n++)
+			x[n].events = POLLIN | (rc[n].queued ? POLLOUT : 0);
 
-	return;
+		poll (x, w->flow_num, 1000);
+
+		for (n = 0; n < w->flow_num; n++) {
+			if (x[n].revents & (POLLERR | POLLHUP)) {
+				D ("connection failed for socket %d", x[n].fd);
+				goto out;
+			}
+			if ((x[n].revents & POLLOUT) &&
+			    rpc_flush (&rc[n], x[n].fd, body, &id) < 0)
+				goto err;
+			if (!(x[n].revents & POLLIN))
+				continue;
+
+			ret = read (x[n].fd, buf, RPC_MAXLEN);
+			if (ret < 0 && errno == EAGAIN)
+				continue;
+			if (ret < 1) {
+				D ("connection closed for socket %d", x[n].fd);
+				goto out;
+			}
+
+			/* fixed size responses, just count bytes */
+			rc[n].got += ret;
+			while (rc[n].got >= tcpgen.rpc_resp) {
+				rc[n].got -= tcpgen.rpc_resp;
+				rc[n].outstanding--;
+				lat_add (&w->lat, nsec_mono () -
+					 rc[n].sent[rc[n].head++ %
+						    RPC_DEPTH_MAX]);
+				if (tcpgen.count &&
+				    __atomic_add_fetch (&tcpgen.done, 1,
+							__ATOMIC_RELAXED) >=
+				    (unsigned long) tcpgen.count)
+					goto out;
+				if (!xmit_reserve ())
+					continue;
+				if (rpc_send (&rc[n], x[n].fd, body, &id) < 0)
+					goto err;
+			}
+		}
+
+		/* another worker completed the last transaction */
+		if (tcpgen.count &&
+		    __atomic_load_n (&tcpgen.done, __ATOMIC_RELAXED) >=
+		    (unsigned long) tcpgen.count)
+			goto out;
+	}
+
+err:
+	D ("failed to send request on socket %d", x[n].fd);
+	perror ("writev");
+out:
+	free (rc);
+	free (x);
+	free (buf);
+	free (body);
 }
 
+/* dst is the histogram of a - b, both cumulative */
+static void
+lat_diff (struct lat_hist * dst, struct lat_hist * a, struct lat_hist * b)
+{
+	int n;
+
+	dst->count = a->count - b->count;
+	dst->sum = a->sum - b->sum;
+	for (n = 0; n < LAT_BUCKETS; n++)
+		dst->hist[n] = a->hist[n] - b->hist[n];
+
+	/* max of the interval is known to its bucket */
+	dst->max = a->max;
+	dst->max = lat_percentile (dst, 100);
+}
+
+/* print transactions of all workers every second and at the end */
 void
-flow_dist_init_power (void)
+client_rpc_stats (void)
 {
-	/* the ratio of flows follows power-law */
+	int n;
+	u_int64_t now, start, last;
+	struct lat_hist * total, * prev, * sec;
+
+	total = calloc (1, sizeof (*total));
+	prev = calloc (1, sizeof (*prev));
+	sec = calloc (1, sizeof (*sec));
+	if (!total || !prev || !sec) {
+		perror ("calloc");
+		goto out;
+	}
 
-	int n, i;
+	start = last = nsec_mono ();
+	while (__atomic_load_n (&tcpgen.running, __ATOMIC_ACQUIRE)) {
+		usleep (10000);
+		now = nsec_mono ();
+		if (now - last < 1000000000ULL)
+			continue;
+
+		memset (total, 0, sizeof (*total));
+		for (n = 0; n < tcpgen.worker_num; n++)
+			lat_merge (total, &tcpgen.workers[n].lat);
+		lat_diff (sec, total, prev);
+		lat_print ("[1s]", sec, (now - last) / 1e9);
+		memcpy (prev, total, sizeof (*prev));
+		last = now;
+	}
 
-	struct flow {
-		int fd;
-		float throughput;
-		float ratio;
-	} flows[MAX_FLOWNUM];
+	memset (total, 0, sizeof (*total));
+	for (n = 0; n < tcpgen.worker_num; n++)
+		lat_merge (total, &tcpgen.workers[n].lat);
+	lat_print ("total", total, (nsec_mono () - start) / 1e9);
 
-	float sum = 0;
-	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].fd = tcpgen.client_sock[n];
-		flows[n].throughput = POWERLAW (n + 1);
-		sum += flows[n].throughput;
+out:
+	free (total);
+	free (prev);
+	free (sec);
+}
+
+/*
+ * Incast (-I). Every connection has a sender thread, and in each round
+ * all of them write a block at the same time to the server. A block is
+ * a transaction with a header-only response, so a sender knows when
+ * the server has received all of its block.
+ */
+
+/* BYTES[,rounds=N][,period=MSEC] */
+int
+incast_parse (char * spec)
+{
+	char * tok, * save;
+
+	tok = strtok_r (spec, ",", &save);
+	if (!tok || sscanf (tok, "%d", &tcpgen.incast_size) != 1 ||
+	    tcpgen.incast_size < 1) {
+		D ("invalid incast block size %s", spec);
+		return -1;
+	}
+
+	while ((tok = strtok_r (NULL, ",", &save)) != NULL) {
+		if (sscanf (tok, "rounds=%d", &tcpgen.incast_rounds) == 1)
+			continue;
+		if (sscanf (tok, "period=%d", &tcpgen.incast_period) == 1)
+			continue;
+		D ("invalid incast option %s", tok);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline u_int64_t
+nsec_real (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_until_real (u_int64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	clock_nanosleep (CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+}
+
+static u_int32_t
+tcp_retrans (int fd)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof (ti);
+
+	memset (&ti, 0, sizeof (ti));
+	getsockopt (fd, IPPROTO_TCP, TCP_INFO, &ti, &len);
+	return ti.tcpi_total_retrans;
+}
+
+/* send a block with its header, and wait for the response */
+static int
+incast_block (struct incast_conn * ic, char * buf, int round)
+{
+	int n, len;
+	struct rpc_hdr * hdr = (struct rpc_hdr *) buf;
+
+	hdr->magic = htonl (RPC_MAGIC);
+	hdr->req_len = htonl (sizeof (*hdr) + tcpgen.incast_size);
+	hdr->resp_len = htonl (sizeof (*hdr));
+	hdr->id = htonl (round);
+	for (n = 0; n < tcpgen.incast_size + sizeof (*hdr); n += len) {
+		len = tcpgen.incast_size + sizeof (*hdr) - n;
+		if (len > RPC_MAXLEN)
+			len = RPC_MAXLEN;
+		if (write_full (ic->fd, buf, len) < 0) {
+			D ("failed to write block to socket %d", ic->fd);
+			return -1;
+		}
+		memset (hdr, 0, sizeof (*hdr));
+	}
+
+	if (read_full (ic->fd, buf, sizeof (*hdr)) < 0) {
+		D ("no response on socket %d", ic->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a sender keeps joining rounds until client_incast () stops them.
+ * errors are left in ic->err for client_incast () to abort. */
+void *
+incast_thread (void * param)
+{
+	int round;
+	char * buf;
+	struct incast_conn * ic = param;
+
+	if ((buf = calloc (1, RPC_MAXLEN)) == NULL) {
+		perror ("calloc");
+		ic->err = 1;
+	}
+
+	for (round = 0; ; round++) {
+		pthread_barrier_wait (&tcpgen.incast_barrier);
+		if (tcpgen.incast_stop)
+			break;
+
+		sleep_until_real (tcpgen.incast_start);
+		if (!ic->err && incast_block (ic, buf, round) < 0)
+			ic->err = 1;
+		ic->done = nsec_real () - tcpgen.incast_start;
+
+		pthread_barrier_wait (&tcpgen.incast_barrier);
+	}
+
+	free (buf);
+	return NULL;
+}
+
+void
+client_incast (void)
+{
+	int n, round;
+	u_int64_t now, period = tcpgen.incast_period * 1000000ULL;
+	u_int64_t min, max, sum;
+	u_int32_t retrans, total = 0;
+	struct incast_conn * ic;
+
+	ic = calloc (tcpgen.flow_num, sizeof (*ic));
+	if (!ic) {
+		perror ("calloc");
+		return;
 	}
 
+	/* senders and this thread */
+	pthread_barrier_init (&tcpgen.incast_barrier, NULL,
+			      tcpgen.flow_num + 1);
 	for (n = 0; n < tcpgen.flow_num; n++) {
-		flows[n].ratio =
-			(int) (flows[n].throughput / sum * SOCKLISTLEN);
+		ic[n].fd = tcpgen.client_sock[n];
+		ic[n].retrans = tcp_retrans (ic[n].fd);
+		pthread_create (&ic[n].tid, NULL, incast_thread, &ic[n]);
+	}
+
+	D ("incast %d connections, %d bytes each", tcpgen.flow_num,
+	   tcpgen.incast_size);
+
+	for (round = 0; !tcpgen.incast_rounds ||
+		     round < tcpgen.incast_rounds; round++) {
+		/* with a period, rounds start at multiples of it on the
+		 * wall clock, so incasts of other processes align */
+		now = nsec_real ();
+		if (period)
+			tcpgen.incast_start = (now / period + 1) * period;
+		else
+			tcpgen.incast_start = now + INCAST_LEAD;
+
+		pthread_barrier_wait (&tcpgen.incast_barrier);
+		pthread_barrier_wait (&tcpgen.incast_barrier);
 
-		if (flows[n].ratio == 0)
-			flows[n].ratio = 1;
+		for (n = 0; n < tcpgen.flow_num; n++) {
+			if (ic[n].err)
+				break;
+		}
+		if (n < tcpgen.flow_num) {
+			D ("round %d aborted, connection %d failed", round, n);
+			break;
+		}
+
+		min = ~0ULL;
+		max = sum = 0;
+		retrans = 0;
+		for (n = 0; n < tcpgen.flow_num; n++) {
+			if (ic[n].done < min)
+				min = ic[n].done;
+			if (ic[n].done > max)
+				max = ic[n].done;
+			sum += ic[n].done;
+			retrans += tcp_retrans (ic[n].fd) - ic[n].retrans;
+			ic[n].retrans = tcp_retrans (ic[n].fd);
+		}
+		total += retrans;
+
+		D ("round %d: completion %.1f usec (first %.1f avg %.1f), "
+		   "%.3f Mbps, %u retrans", round, max / 1e3, min / 1e3,
+		   sum / tcpgen.flow_num / 1e3,
+		   (double) tcpgen.incast_size * tcpgen.flow_num * 8 /
+		   (max / 1e3), retrans);
 	}
 
-	int ssum = 0, slen = 0;
+	/* release the senders from the next round */
+	tcpgen.incast_stop = 1;
+	pthread_barrier_wait (&tcpgen.incast_barrier);
+	for (n = 0; n < tcpgen.flow_num; n++)
+		pthread_join (ic[n].tid, NULL);
+
+	D ("incast %d rounds, %u retrans", round, total);
+	pthread_barrier_destroy (&tcpgen.incast_barrier);
+	free (ic);
+}
+
+/* rate of each flow in its share of the weight, by SO_MAX_PACING_RATE */
+int
+flow_pacing_init (void)
+{
+	int n;
+	double mbps, sum = 0;
+	u_int64_t rate;
+
+	for (n = 0; n < tcpgen.flow_num; n++)
+		sum += tcpgen.weight[n];
+
 	for (n = 0; n < tcpgen.flow_num; n++) {
-		D ("Flow %3d ratio is %.2f%%", n,
-		   flows[n].ratio / SOCKLISTLEN * 100);
-		ssum += flows[n].ratio / SOCKLISTLEN * 100;
+		if (tcpgen.flow_rate)
+			mbps = tcpgen.flow_rate;
+		else
+			mbps = tcpgen.rate * tcpgen.weight[n] / sum;
 
-		for (i = 0; i < flows[n].ratio; i++) {
-			tcpgen.socklist[slen++] = flows[n].fd;
+		rate = mbps * 1000000 / 8;	/* bytes per sec */
+		if (setsockopt (tcpgen.client_sock[n], SOL_SOCKET,
+				SO_MAX_PACING_RATE, &rate, sizeof (rate)) < 0) {
+			perror ("failed to set SO_MAX_PACING_RATE");
+			return -1;
 		}
+
+		/* the kernel paces, writes go to any socket with room */
+		fcntl (tcpgen.client_sock[n], F_SETFL,
+		       fcntl (tcpgen.client_sock[n], F_GETFL) | O_NONBLOCK);
+
+		D ("Flow %3d rate is %.3f Mbps", n, mbps);
 	}
 
-	tcpgen.socklistlen = slen;
+	return 0;
+}
 
-	return;
+/* keep send buffers of all paced sockets of a worker full */
+void
+worker_paced (struct worker * w)
+{
+	int n, ret;
+	char buf[9216];
+	struct pollfd * x;
+
+	x = calloc (w->flow_num, sizeof (*x));
+	if (!x) {
+		perror ("calloc");
+		return;
+	}
+
+	memset (buf, 0, sizeof (buf));
+	for (n = 0; n < w->flow_num; n++) {
+		x[n].fd = tcpgen.client_sock[w->flows[n]];
+		x[n].events = POLLOUT;
+	}
+
+	while (1) {
+		poll (x, w->flow_num, -1);
+
+		for (n = 0; n < w->flow_num; n++) {
+			if (x[n].revents & (POLLERR | POLLHUP)) {
+				D ("connection failed for socket %d", x[n].fd);
+				goto out;
+			}
+			if (!(x[n].revents & POLLOUT))
+				continue;
+
+			if (!xmit_reserve ())
+				goto out;
+
+			ret = write (x[n].fd, buf, tcpgen.data_len);
+			if (ret < 0)
+				continue;	/* EAGAIN */
+
+			if (tcpgen.verbose)
+				D ("write %d bytes to socket %d", ret,
+				   x[n].fd);
+		}
+	}
+
+out:
+	free (x);
+}
+
+/* write to the socklist of a worker */
+void
+worker_stream (struct worker * w)
+{
+	int n, ret;
+	char buf[9216];
+
+	memset (buf, 0, sizeof (buf));
+
+	while (1) {
+		for (n = 0; n < w->socklistlen; n++) {
+			if (!xmit_reserve ())
+				return;
+
+			ret = write (w->socklist[n], buf, tcpgen.data_len);
+			if (ret < 0) {
+				D ("failed to write %d byte to socket %d",
+				   tcpgen.data_len, w->socklist[n]);
+				return;
+			}
+
+			if (tcpgen.verbose)
+				D ("write %d bytes to socket %d", ret,
+				   w->socklist[n]);
+
+			if (w->interval)
+				usleep (w->interval);
+		}
+	}
+}
+
+void *
+worker_thread (void * param)
+{
+	struct worker * w = param;
+
+	if (tcpgen.rpc_req)
+		worker_rpc (w);
+	else if (tcpgen.rate || tcpgen.flow_rate)
+		worker_paced (w);
+	else
+		worker_stream (w);
+
+	__atomic_sub_fetch (&tcpgen.running, 1, __ATOMIC_RELEASE);
+
+	return NULL;
 }
 
 void *
 client_thread (void * param)
 {
-	int n, ret, fd, port, sknum = 0;
-	char buf[9216];
-	unsigned long xmitted = 0;
+	int n, fd, port, sknum = 0;
 
 	D ("Start to connect");
 
+	tcpgen.client_sock = calloc (tcpgen.flow_num, sizeof (int));
+	tcpgen.weight = calloc (tcpgen.flow_num, sizeof (double));
+	if (!tcpgen.client_sock || !tcpgen.weight) {
+		perror ("calloc");
+		return NULL;
+	}
+
 	/* create tcp client sockets for each flow */
 	for (sknum = 0; sknum < tcpgen.flow_num; sknum++) {
 		if (!tcpgen.randomized)
@@ -431,59 +1686,53 @@ client_thread (void * param)
 		else
 			port = RANDOM_PORT ();
 
-		fd = tcp_client_socket (tcpgen.dst, tcpgen.src,
-					TCPGEN_PORT, port);
+		fd = tcp_client_socket (&tcpgen.dst, &tcpgen.src,
+					tcpgen.rpc_req || tcpgen.incast_size ?
+					TCPGEN_RPC_PORT : TCPGEN_PORT, port);
 
 		if (!fd) {
 			goto err;
 		}
 
 		tcpgen.client_sock[sknum] = fd;
+		conn_add (fd, 0);
 	}
 
 	/* initalize flow distribution */
-	switch (tcpgen.flow_dist) {
-	case FLOWDIST_SAME :
-		flow_dist_init_same ();
-		break;
-	case FLOWDIST_RANDOM :
-		flow_dist_init_random ();
-		break;
-	case FLOWDIST_POWER :
-		flow_dist_init_power ();
-		break;
-	default :
-		D ("invalid flow distribution pattern");
+	if (flow_dist_init () < 0)
+		goto err;
+
+	if (tcpgen.incast_size) {
+		client_incast ();
 		goto err;
 	}
 
-	/* send packets */
+	if ((tcpgen.rate || tcpgen.flow_rate) && flow_pacing_init () < 0)
+		goto err;
 
-	while (1) {
-		for (n = 0; n < tcpgen.socklistlen; n++) {
-			ret = write (tcpgen.socklist[n], buf, tcpgen.data_len);
-			if (ret < 0) {
-				D ("failed to write %d byte to socket %d",
-				   tcpgen.data_len, tcpgen.socklist[n]);
-				goto err;
-			}
+	if (worker_init () < 0)
+		goto err;
 
-			if (tcpgen.verbose)
-				D ("write %d bytes to socket %d", ret,
-				   tcpgen.socklist[n]);
+	/* send packets */
+	tcpgen.running = tcpgen.worker_num;
+	for (n = 0; n < tcpgen.worker_num; n++) {
+		pthread_create (&tcpgen.workers[n].tid, NULL, worker_thread,
+				&tcpgen.workers[n]);
+		if (tcpgen.worker_num > 1)
+			worker_pin (&tcpgen.workers[n]);
+	}
 
-			if (tcpgen.interval)
-				usleep (tcpgen.interval);
+	if (tcpgen.rpc_req)
+		client_rpc_stats ();
 
-			xmitted++;
-			if (tcpgen.count && tcpgen.count < xmitted)
-				goto err;
-		}			
-	}
+	for (n = 0; n < tcpgen.worker_num; n++)
+		pthread_join (tcpgen.workers[n].tid, NULL);
 
 err:
-	for (n = 0; n < sknum; n++)
+	for (n = 0; n < sknum; n++) {
+		conn_del (tcpgen.client_sock[n]);
 		close (tcpgen.client_sock[n]);
+	}
 
 	return NULL;
 }
@@ -491,29 +1740,30 @@ err:
 int
 main (int argc, char ** argv)
 {
-	int ch, ret, seed = 0, d = 0;
+	int n, ch, seed = 0, d = 0;
+	pthread_t tid;
+	struct rlimit rl;
 
 	/* set default value */
 	memset (&tcpgen, 0, sizeof (tcpgen));
 	tcpgen.flow_dist = FLOWDIST_SAME;
 	tcpgen.flow_num = 1;
+	tcpgen.worker_num = 1;
+	for (n = 0; n < CONN_MAX; n++)
+		tcpgen.conns[n].fd = -1;
 	tcpgen.data_len = 984; /* 1024 byte packet excluding ether header */
 
-	while ((ch = getopt (argc, argv, "d:B:scn:t:x:i:l:rm:pDv")) != -1) {
+	while ((ch = getopt (argc, argv, "d:B:scn:w:t:x:i:l:rm:pDvR:P:k:T:o:Q:I:")) != -1) {
 		switch (ch) {
 		case 'd' :
-			ret = inet_pton (AF_INET, optarg, &tcpgen.dst);
-			if (ret < 0) {
+			if (addr_parse (optarg, &tcpgen.dst) < 0) {
 				D ("invalid dst address %s", optarg);
-				perror ("inet_pton");
 				return -1;
 			}
 			break;
 		case 'B' :
-			ret = inet_pton (AF_INET, optarg, &tcpgen.src);
-			if (ret < 0) {
+			if (addr_parse (optarg, &tcpgen.src) < 0) {
 				D ("invalid src address %s", optarg);
-				perror ("inet_pton");
 				return -1;
 			}
 			break;
@@ -525,8 +1775,16 @@ main (int argc, char ** argv)
 			break;
 		case 'n' :
 			tcpgen.flow_num = atoi (optarg);
-			if (tcpgen.flow_num > MAX_FLOWNUM) {
-				D ("max number of flows is %d", MAX_FLOWNUM);
+			if (tcpgen.flow_num < 1) {
+				D ("invalid number of flows %s", optarg);
+				return -1;
+			}
+			break;
+		case 'w' :
+			tcpgen.worker_num = atoi (optarg);
+			if (tcpgen.worker_num < 1 ||
+			    tcpgen.worker_num > WORKER_MAX) {
+				D ("number of workers is 1 to %d", WORKER_MAX);
 				return -1;
 			}
 			break;
@@ -551,6 +1809,42 @@ main (int argc, char ** argv)
 		case 'l' :
 			tcpgen.data_len = atoi (optarg);
 			break;
+		case 'R' :
+			tcpgen.rate = atof (optarg);
+			break;
+		case 'P' :
+			tcpgen.flow_rate = atof (optarg);
+			break;
+		case 'I' :
+			if (incast_parse (optarg) < 0)
+				return -1;
+			break;
+		case 'Q' :
+			if (rpc_parse (optarg) < 0)
+				return -1;
+			break;
+		case 'k' :
+			if (sock_tune_parse (optarg) < 0)
+				return -1;
+			break;
+		case 'T' :
+			tcpgen.sample_interval = atoi (optarg);
+			break;
+		case 'o' :
+			if (strncmp (optarg, "csv:", 4) == 0)
+				tcpgen.out = fopen (optarg + 4, "w");
+			else if (strncmp (optarg, "bin:", 4) == 0) {
+				tcpgen.out = fopen (optarg + 4, "w");
+				tcpgen.out_bin = 1;
+			} else {
+				D ("invalid output %s", optarg);
+				return -1;
+			}
+			if (!tcpgen.out) {
+				perror ("fopen");
+				return -1;
+			}
+			break;
 		case 'r' :
 			tcpgen.randomized = 1;
 			break;
@@ -572,19 +1866,65 @@ main (int argc, char ** argv)
 		}
 	}
 
-	if (seed)
-		srand (seed);
-	else
-		srand (time (NULL));
+	fastrand_init (&tcpgen.rnd, seed ? seed : time (NULL), 0);
+
+	if (tcpgen.client_mode && !tcpgen.dst.ss_family) {
+		D ("destination address is not specified");
+		return -1;
+	}
+
+	if (tcpgen.rate < 0 || tcpgen.flow_rate < 0 ||
+	    (tcpgen.rate && tcpgen.flow_rate)) {
+		D ("-R and -P are positive and exclusive");
+		return -1;
+	}
+
+	if (tcpgen.src.ss_family &&
+	    tcpgen.src.ss_family != tcpgen.dst.ss_family) {
+		D ("address families of src and dst are different");
+		return -1;
+	}
+
+	if (tcpgen.out && !tcpgen.sample_interval) {
+		D ("-o needs -T");
+		return -1;
+	}
+
+	if (tcpgen.incast_size && tcpgen.worker_num > 1) {
+		D ("-I keeps a thread for each connection, not with -w");
+		return -1;
+	}
 
 	if (d)
 		daemon (1, 0);
 
-	if (tcpgen.server_mode)
+	/* a socket for each flow */
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &rl);
+	}
+
+	pthread_mutex_init (&tcpgen.conn_lock, NULL);
+	if (tcpgen.sample_interval) {
+		tcpgen.sample_start = nsec_mono ();
+		pthread_create (&tid, NULL, sampler_thread, NULL);
+		pthread_detach (tid);
+	}
+
+	if (tcpgen.server_mode) {
+		pthread_create (&tid, NULL, rpc_server_thread, NULL);
+		pthread_detach (tid);
 		server_thread (NULL);
+	}
 
-	else if (tcpgen.client_mode)
+	else if (tcpgen.client_mode) {
+		/* a closed connection fails its write instead */
+		signal (SIGPIPE, SIG_IGN);
 		client_thread (NULL);
+	}
+
+	if (tcpgen.sample_interval)
+		sampler_summary ();
 
 	D ("tcpgen finished");
 